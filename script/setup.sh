@@ -3,6 +3,8 @@
 sudo apt update
 sudo apt install apache2-dev 
 sudo apt install libopencv-dev
+sudo apt install zlib1g-dev
+sudo apt install libjpeg-dev
 sudo apt install cmake
 sudo apt install libgtest-dev
 cd /usr/src/gtest/
@@ -0,0 +1,94 @@
+#include "damage_region.h"
+
+const uint16_t damage_region::TILE_SIZE;
+
+void damage_region::resize(uint16_t width, uint16_t height)
+{
+    this->width = width;
+    this->height = height;
+    this->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    this->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    this->tile_sequences.assign((size_t)this->tiles_x * this->tiles_y, 0);
+    // everything is new for the frame buffer of the new size
+    this->add_all();
+}
+
+void damage_region::add(uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+    if (width == 0 || height == 0 || x >= this->width || y >= this->height) {
+        return;
+    }
+    uint16_t last_x = std::min<uint32_t>(x + width, this->width) - 1;
+    uint16_t last_y = std::min<uint32_t>(y + height, this->height) - 1;
+    // changes belong to the frame which is committed next
+    for (int tile_y = y / TILE_SIZE; tile_y <= last_y / TILE_SIZE; tile_y++) {
+        for (int tile_x = x / TILE_SIZE; tile_x <= last_x / TILE_SIZE; tile_x++) {
+            this->tile_sequences[this->tiles_x * tile_y + tile_x] = this->sequence + 1;
+        }
+    }
+    this->pending = true;
+}
+
+void damage_region::add_all()
+{
+    this->add(0, 0, this->width, this->height);
+}
+
+uint32_t damage_region::commit()
+{
+    if (this->pending) {
+        this->sequence++;
+        this->pending = false;
+    }
+    return this->sequence;
+}
+
+std::vector<damage_rect_t> damage_region::get_rects(uint32_t since_sequence) const
+{
+    std::vector<damage_rect_t> rects;
+    // rects of the previous tile row, to be extended downwards if the next row has the same run
+    std::vector<size_t> upper_rects;
+    for (int tile_y = 0; tile_y < this->tiles_y; tile_y++) {
+        std::vector<size_t> current_rects;
+        int tile_x = 0;
+        while (tile_x < this->tiles_x) {
+            uint32_t tile_sequence = this->tile_sequences[this->tiles_x * tile_y + tile_x];
+            // changes not committed yet are not visible
+            if (tile_sequence <= since_sequence || tile_sequence > this->sequence) {
+                tile_x++;
+                continue;
+            }
+            // coalesce the run of changed tiles in this row
+            int first_tile_x = tile_x;
+            while (tile_x < this->tiles_x) {
+                tile_sequence = this->tile_sequences[this->tiles_x * tile_y + tile_x];
+                if (tile_sequence <= since_sequence || tile_sequence > this->sequence) {
+                    break;
+                }
+                tile_x++;
+            }
+            damage_rect_t rect = {};
+            rect.x = first_tile_x * TILE_SIZE;
+            rect.y = tile_y * TILE_SIZE;
+            rect.width = std::min<uint32_t>(tile_x * TILE_SIZE, this->width) - rect.x;
+            rect.height = std::min<uint32_t>((tile_y + 1) * TILE_SIZE, this->height) - rect.y;
+            // and with the same run of the upper row
+            bool merged = false;
+            for (size_t i = 0; i < upper_rects.size(); i++) {
+                damage_rect_t &upper = rects[upper_rects[i]];
+                if (upper.x == rect.x && upper.width == rect.width && upper.y + upper.height == rect.y) {
+                    upper.height += rect.height;
+                    current_rects.push_back(upper_rects[i]);
+                    merged = true;
+                    break;
+                }
+            }
+            if (!merged) {
+                current_rects.push_back(rects.size());
+                rects.push_back(rect);
+            }
+        }
+        upper_rects.swap(current_rects);
+    }
+    return rects;
+}
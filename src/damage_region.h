@@ -0,0 +1,39 @@
+#ifndef __DAMAGE_REGION_H__
+#define __DAMAGE_REGION_H__
+
+#include <bits/stdc++.h>
+
+typedef struct damage_rect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+} damage_rect_t;
+
+// Accumulates the changed area of the frame buffer as a bitmap of tiles.
+// Each tile remembers the frame sequence number in which it was changed last,
+// so the changes since any earlier frame can be answered.
+class damage_region
+{
+ private:
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint16_t tiles_x = 0;
+    uint16_t tiles_y = 0;
+    // sequence number of the last committed frame
+    uint32_t sequence = 0;
+    bool pending = false;
+    std::vector<uint32_t> tile_sequences;
+ public:
+    static const uint16_t TILE_SIZE = 64;
+
+    void resize(uint16_t width, uint16_t height);
+    void add(uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+    void add_all();
+    uint32_t commit();
+    std::vector<damage_rect_t> get_rects(uint32_t since_sequence) const;
+
+    const uint32_t get_sequence() const { return this->sequence; };
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "frame_buffer.h"
+
+const uint16_t frame_buffer::TILE_SIZE;
+const size_t frame_buffer::CACHE_LINE_SIZE;
+
+static const size_t TILE_PIXELS = frame_buffer::TILE_SIZE * frame_buffer::TILE_SIZE;
+
+void frame_buffer::resize(uint16_t width, uint16_t height)
+{
+    this->width = width;
+    this->height = height;
+    this->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    uint16_t tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    // tiles on the right and bottom edges are padded to the full size,
+    // and the room for a cache line is left to align the first one
+    size_t alignment = CACHE_LINE_SIZE / sizeof(uint32_t);
+    this->buf.assign((size_t)this->tiles_x * tiles_y * TILE_PIXELS + alignment, 0);
+    uintptr_t address = (uintptr_t)this->buf.data();
+    this->origin = ((CACHE_LINE_SIZE - address % CACHE_LINE_SIZE) % CACHE_LINE_SIZE) / sizeof(uint32_t);
+}
+
+uint32_t *frame_buffer::get_span(uint16_t x, uint16_t y, uint16_t *length)
+{
+    *length = std::min<uint16_t>(TILE_SIZE - x % TILE_SIZE, this->width - x);
+    return &this->buf[this->get_offset(x, y)];
+}
+
+const uint32_t *frame_buffer::get_span(uint16_t x, uint16_t y, uint16_t *length) const
+{
+    *length = std::min<uint16_t>(TILE_SIZE - x % TILE_SIZE, this->width - x);
+    return &this->buf[this->get_offset(x, y)];
+}
+
+void frame_buffer::read_row(uint16_t x, uint16_t y, uint16_t width, uint32_t *row) const
+{
+    uint16_t length = 0;
+    for (int i = 0; i < width; i += length) {
+        const uint32_t *span = this->get_span(x + i, y, &length);
+        length = std::min<uint16_t>(length, width - i);
+        memcpy(&row[i], span, length * sizeof(uint32_t));
+    }
+}
+
+void frame_buffer::write_row(uint16_t x, uint16_t y, uint16_t width, const uint32_t *row)
+{
+    uint16_t length = 0;
+    for (int i = 0; i < width; i += length) {
+        uint32_t *span = this->get_span(x + i, y, &length);
+        length = std::min<uint16_t>(length, width - i);
+        memcpy(span, &row[i], length * sizeof(uint32_t));
+    }
+}
+
+void frame_buffer::fill_rect(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint32_t pixel)
+{
+    uint16_t length = 0;
+    for (int j = y; j < y + height; j++) {
+        for (int i = 0; i < width; i += length) {
+            uint32_t *span = this->get_span(x + i, j, &length);
+            length = std::min<uint16_t>(length, width - i);
+            std::fill(span, span + length, pixel);
+        }
+    }
+}
+
+void frame_buffer::copy_rect(uint16_t src_x, uint16_t src_y, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+    // copy rows in the direction that never overwrites source rows not yet copied,
+    // a row goes through row_buf for the horizontal overlap
+    this->row_buf.resize(width);
+    for (int i = 0; i < height; i++) {
+        int row = (src_y < y) ? height - 1 - i : i;
+        this->read_row(src_x, src_y + row, width, this->row_buf.data());
+        this->write_row(x, y + row, width, this->row_buf.data());
+    }
+}
+
+//// private /////
+
+size_t frame_buffer::get_offset(uint16_t x, uint16_t y) const
+{
+    size_t tile = (size_t)(y / TILE_SIZE) * this->tiles_x + x / TILE_SIZE;
+    return this->origin + tile * TILE_PIXELS + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+}
@@ -0,0 +1,43 @@
+#ifndef __FRAME_BUFFER_H__
+#define __FRAME_BUFFER_H__
+
+#include <bits/stdc++.h>
+
+// Pixel containers of the frame buffer kept as tiles of 64x64 instead of whole rows.
+// Each tile is contiguous and starts at a cache line, so the work on a tile
+// such as decoding a ZRLE tile or converting a damaged area stays in its own memory.
+// A row of the frame buffer is a span in each tile it crosses.
+class frame_buffer
+{
+ private:
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint16_t tiles_x = 0;
+    // tiles one after another, the first one starts at origin
+    std::vector<uint32_t> buf;
+    size_t origin = 0;
+    // for copy_rect()
+    std::vector<uint32_t> row_buf;
+
+    size_t get_offset(uint16_t x, uint16_t y) const;
+ public:
+    static const uint16_t TILE_SIZE = 64;
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    // all pixels are 0 after resizing
+    void resize(uint16_t width, uint16_t height);
+    // pixels from (x, y) up to the right edge of its tile, length is set to their number
+    uint32_t *get_span(uint16_t x, uint16_t y, uint16_t *length);
+    const uint32_t *get_span(uint16_t x, uint16_t y, uint16_t *length) const;
+    // width pixels of a row from (x, y), gathered from or scattered to the spans
+    void read_row(uint16_t x, uint16_t y, uint16_t width, uint32_t *row) const;
+    void write_row(uint16_t x, uint16_t y, uint16_t width, const uint32_t *row);
+    void fill_rect(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint32_t pixel);
+    // the source and the destination may overlap
+    void copy_rect(uint16_t src_x, uint16_t src_y, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+
+    const uint16_t get_width() const { return this->width; };
+    const uint16_t get_height() const { return this->height; };
+};
+
+#endif
@@ -0,0 +1,206 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_SCALER_X86
+#endif
+
+#include "image_scaler.h"
+
+image_scaler::image_scaler()
+{
+    this->select_fastest_kernel();
+}
+
+void image_scaler::resize(uint16_t src_width, uint16_t src_height, uint16_t width, uint16_t height)
+{
+    this->src_width = src_width;
+    this->src_height = src_height;
+    this->width = std::min(width, src_width);
+    this->height = std::min(height, src_height);
+    this->x_bounds.clear();
+    this->y_bounds.clear();
+    this->x_reciprocals.clear();
+    if (this->width == 0 || this->height == 0) {
+        return;
+    }
+    // every box has at least one pixel as the image is not larger
+    this->x_bounds.resize(this->width + 1);
+    for (int i = 0; i <= this->width; i++) {
+        this->x_bounds[i] = (uint32_t)i * src_width / this->width;
+    }
+    this->x_reciprocals.resize(this->width);
+    for (int i = 0; i < this->width; i++) {
+        this->x_reciprocals[i] = 1.0 / (this->x_bounds[i + 1] - this->x_bounds[i]);
+    }
+    this->y_bounds.resize(this->height + 1);
+    for (int j = 0; j <= this->height; j++) {
+        this->y_bounds[j] = (uint32_t)j * src_height / this->height;
+    }
+}
+
+bool image_scaler::is_supported(kernel_t kernel)
+{
+    switch (kernel) {
+    case KERNEL_SCALAR:
+        return true;
+#ifdef IMAGE_SCALER_X86
+    case KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+bool image_scaler::select_kernel(kernel_t kernel)
+{
+    if (!is_supported(kernel)) {
+        return false;
+    }
+    this->kernel = kernel;
+    return true;
+}
+
+void image_scaler::map_area(uint16_t *x, uint16_t *y, uint16_t *width, uint16_t *height) const
+{
+    if (this->width == 0 || this->height == 0) {
+        *width = *height = 0;
+        return;
+    }
+    // from the box with the first column or row in it to the first box after the last one
+    uint32_t first_x = (uint32_t)*x * this->width / this->src_width;
+    uint32_t first_y = (uint32_t)*y * this->height / this->src_height;
+    uint32_t last_x = ((uint32_t)(*x + *width) * this->width + this->src_width - 1) / this->src_width;
+    uint32_t last_y = ((uint32_t)(*y + *height) * this->height + this->src_height - 1) / this->src_height;
+    *x = first_x;
+    *y = first_y;
+    *width = std::min<uint32_t>(last_x, this->width) - first_x;
+    *height = std::min<uint32_t>(last_y, this->height) - first_y;
+}
+
+void image_scaler::scale(const frame_buffer &frame, const pixel_converter &converter,
+                         uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *image, size_t stride)
+{
+    if (width == 0 || height == 0 || frame.get_width() != this->src_width || frame.get_height() != this->src_height) {
+        return;
+    }
+    // columns of the frame buffer under the boxes of the area
+    uint16_t first = this->x_bounds[x];
+    uint16_t columns = this->x_bounds[x + width] - first;
+    this->row_buf.resize(columns);
+    this->bgr_buf.resize(columns * 3);
+    this->sums.resize(columns * 3);
+    for (int j = y; j < y + height; j++) {
+        std::fill(this->sums.begin(), this->sums.end(), 0);
+        for (int src_y = this->y_bounds[j]; src_y < this->y_bounds[j + 1]; src_y++) {
+            // gathered first, the kernels of the converter work best on long rows
+            frame.read_row(first, src_y, columns, this->row_buf.data());
+            converter.convert_row(this->row_buf.data(), this->bgr_buf.data(), columns);
+            this->add_row(this->bgr_buf.data(), this->sums.data(), columns * 3);
+        }
+        int64_t box_height = this->y_bounds[j + 1] - this->y_bounds[j];
+        double y_reciprocal = 1.0 / box_height;
+        const uint32_t *sum = this->sums.data();
+        const uint16_t *bounds = &this->x_bounds[x];
+        const double *x_reciprocals = &this->x_reciprocals[x];
+        uint8_t *dst = image + stride * j + x * 3;
+        for (int i = 0; i < width; i++) {
+            // signed for the conversion into double in one instruction
+            int64_t blue = 0, green = 0, red = 0;
+            for (int column = bounds[i]; column < bounds[i + 1]; column++, sum += 3) {
+                blue += sum[0];
+                green += sum[1];
+                red += sum[2];
+            }
+            // rounded average of the box, (total + area / 2) / area.
+            // another half of 1 / area keeps the product off the integers below, so it is exact
+            int64_t half = (bounds[i + 1] - bounds[i]) * box_height / 2;
+            double reciprocal = x_reciprocals[i] * y_reciprocal;
+            dst[i * 3 + 0] = (blue + half + 0.5) * reciprocal;
+            dst[i * 3 + 1] = (green + half + 0.5) * reciprocal;
+            dst[i * 3 + 2] = (red + half + 0.5) * reciprocal;
+        }
+    }
+}
+
+//// private /////
+
+void image_scaler::select_fastest_kernel()
+{
+    if (!this->select_kernel(KERNEL_AVX2) && !this->select_kernel(KERNEL_SSE2)) {
+        this->select_kernel(KERNEL_SCALAR);
+    }
+}
+
+void image_scaler::add_row(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    switch (this->kernel) {
+    case KERNEL_AVX2:
+        this->add_row_avx2(src, sums, length);
+        break;
+    case KERNEL_SSE2:
+        this->add_row_sse2(src, sums, length);
+        break;
+    default:
+        this->add_row_scalar(src, sums, length);
+        break;
+    }
+}
+
+void image_scaler::add_row_scalar(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    for (size_t i = 0; i < length; i++) {
+        sums[i] += src[i];
+    }
+}
+
+#ifdef IMAGE_SCALER_X86
+
+__attribute__((target("sse2")))
+void image_scaler::add_row_sse2(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    // 16 bytes widened to 16bit then to 32bit, in 4 vectors of sums
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i *s = (__m128i*)(sums + i);
+        _mm_storeu_si128(s + 0, _mm_add_epi32(_mm_loadu_si128(s + 0), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+    this->add_row_scalar(src + i, sums + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void image_scaler::add_row_avx2(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    // 8 bytes at a time widened straight to 32bit
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int k = 0; k < 32; k += 8) {
+            __m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + k)));
+            __m256i *s = (__m256i*)(sums + i + k);
+            _mm256_storeu_si256(s, _mm256_add_epi32(_mm256_loadu_si256(s), values));
+        }
+    }
+    this->add_row_sse2(src + i, sums + i, length - i);
+}
+
+#else
+
+void image_scaler::add_row_sse2(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    this->add_row_scalar(src, sums, length);
+}
+
+void image_scaler::add_row_avx2(const uint8_t *src, uint32_t *sums, size_t length) const
+{
+    this->add_row_scalar(src, sums, length);
+}
+
+#endif
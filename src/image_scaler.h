@@ -0,0 +1,63 @@
+#ifndef __IMAGE_SCALER_H__
+#define __IMAGE_SCALER_H__
+
+#include <bits/stdc++.h>
+
+#include "frame_buffer.h"
+#include "pixel_converter.h"
+
+// Shrinks the frame buffer into a smaller BGR image with a box filter.
+// Each pixel of the image is the average of the box of pixels it covers in the frame buffer,
+// boxes are whole pixels and tile the frame buffer without overlapping, so a pixel of the frame buffer
+// is read once and an area of the image can be made again from the damaged area alone.
+// The rows of a box are summed up by a vectorized kernel selected from what the CPU supports.
+class image_scaler
+{
+ public:
+    typedef enum kernel {
+        KERNEL_SCALAR,
+        KERNEL_SSE2,
+        KERNEL_AVX2,
+    } kernel_t;
+ private:
+    uint16_t src_width = 0;
+    uint16_t src_height = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    // first column and row of the frame buffer in each box, then the end of the last box
+    std::vector<uint16_t> x_bounds;
+    std::vector<uint16_t> y_bounds;
+    // 1 / the width of each box, instead of dividing every pixel
+    std::vector<double> x_reciprocals;
+    // a row of a box, in the frame buffer and in BGR, and the sums of its columns
+    std::vector<uint32_t> row_buf;
+    std::vector<uint8_t> bgr_buf;
+    std::vector<uint32_t> sums;
+    kernel_t kernel = KERNEL_SCALAR;
+
+    void select_fastest_kernel();
+    void add_row(const uint8_t *src, uint32_t *sums, size_t length) const;
+    void add_row_scalar(const uint8_t *src, uint32_t *sums, size_t length) const;
+    void add_row_sse2(const uint8_t *src, uint32_t *sums, size_t length) const;
+    void add_row_avx2(const uint8_t *src, uint32_t *sums, size_t length) const;
+ public:
+    image_scaler();
+    // the image is no larger than the frame buffer
+    void resize(uint16_t src_width, uint16_t src_height, uint16_t width, uint16_t height);
+    // false if the CPU does not allow the kernel
+    bool select_kernel(kernel_t kernel);
+    static bool is_supported(kernel_t kernel);
+    // an area of the frame buffer into the area of the image with the boxes over it
+    void map_area(uint16_t *x, uint16_t *y, uint16_t *width, uint16_t *height) const;
+    // an area of the image from its boxes, rows of the image are stride bytes apart
+    void scale(const frame_buffer &frame, const pixel_converter &converter,
+               uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *image, size_t stride);
+
+    kernel_t get_kernel() const { return this->kernel; };
+    const uint16_t get_src_width() const { return this->src_width; };
+    const uint16_t get_src_height() const { return this->src_height; };
+    const uint16_t get_width() const { return this->width; };
+    const uint16_t get_height() const { return this->height; };
+};
+
+#endif
@@ -0,0 +1,359 @@
+#include "jpeg_encoder.h"
+
+const int jpeg_encoder::DEFAULT_QUALITY;
+
+// the output buffer starts with this size and is doubled when it gets full
+static const size_t INITIAL_OUTPUT_SIZE = 64 * 1024;
+// rows passed to libjpeg at once
+static const int ROWS_PER_WRITE = 16;
+// rows of Y in the largest MCU, 4:2:0
+static const int MCU_ROWS = ycbcr_planes::MCU_SIZE;
+// markers
+static const uint8_t MARKER_PREFIX = 0xff;
+static const uint8_t MARKER_SOI = 0xd8;
+static const uint8_t MARKER_EOI = 0xd9;
+static const uint8_t MARKER_SOF0 = 0xc0;
+static const uint8_t MARKER_SOS = 0xda;
+static const uint8_t MARKER_RST0 = 0xd0;
+static const uint8_t MARKER_RST7 = 0xd7;
+// restart markers are numbered RST0 to RST7 over and over
+static const int RST_CYCLE = 8;
+
+jpeg_encoder::jpeg_encoder()
+{
+}
+
+jpeg_encoder::jpeg_encoder(const jpeg_encoder &other)
+    : quality(other.quality), subsampling(other.subsampling), threads(other.threads)
+{
+}
+
+jpeg_encoder &jpeg_encoder::operator=(const jpeg_encoder &other)
+{
+    this->quality = other.quality;
+    this->subsampling = other.subsampling;
+    this->set_threads(other.threads);
+    return *this;
+}
+
+void jpeg_encoder::set_threads(int threads)
+{
+    threads = std::max(1, threads);
+    if (threads != this->threads) {
+        // started again by the next encode()
+        this->pool.reset();
+    }
+    this->threads = threads;
+}
+
+bool jpeg_encoder::encode(const uint8_t *pixels, uint16_t width, uint16_t height, size_t stride, std::vector<uint8_t> &out)
+{
+    row_source_t source = {pixels, stride, NULL};
+    return this->encode_rows(source, width, height, out);
+}
+
+bool jpeg_encoder::encode(const ycbcr_planes &planes, std::vector<uint8_t> &out)
+{
+    row_source_t source = {NULL, 0, &planes};
+    return this->encode_rows(source, planes.get_width(), planes.get_height(), out);
+}
+
+void jpeg_encoder::invalidate(uint16_t y, uint16_t height)
+{
+    if (this->bands.empty() || height == 0) {
+        return;
+    }
+    size_t first = y / this->band_source.band_height;
+    size_t last = std::min<size_t>((y + height - 1) / this->band_source.band_height, this->bands.size() - 1);
+    for (size_t i = first; i <= last; i++) {
+        this->bands[i].valid = false;
+    }
+}
+
+//// private /////
+
+jpeg_encoder::compressor *jpeg_encoder::get_compressor(size_t index)
+{
+    while (this->compressors.size() <= index) {
+        this->compressors.push_back(std::unique_ptr<compressor>(new compressor()));
+    }
+    return this->compressors[index].get();
+}
+
+bool jpeg_encoder::encode_rows(const row_source_t &source, uint16_t width, uint16_t height, std::vector<uint8_t> &out)
+{
+    if (width == 0 || height == 0) {
+        this->error = "empty image";
+        return false;
+    }
+    // planes can only be compressed in the subsampling they have
+    subsampling_t subsampling = (source.planes != NULL) ? source.planes->get_subsampling() : this->subsampling;
+    compressor *whole = this->get_compressor(0);
+    int band_height = whole->get_mcu_height(subsampling) * RST_CYCLE;
+    if (height > band_height) {
+        return this->encode_bands(source, width, height, subsampling, band_height, out);
+    }
+    this->invalidate_all();
+    if (!whole->compress(source, 0, width, height, this->quality, subsampling, 0, out)) {
+        this->error = whole->get_error();
+        return false;
+    }
+    return true;
+}
+
+bool jpeg_encoder::encode_bands(const row_source_t &source, uint16_t width, uint16_t height,
+                                subsampling_t subsampling, int band_height, std::vector<uint8_t> &out)
+{
+    const band_source_t &cached = this->band_source;
+    if (source.pixels != cached.rows.pixels || source.stride != cached.rows.stride || source.planes != cached.rows.planes ||
+        width != cached.width || height != cached.height ||
+        this->quality != cached.quality || subsampling != cached.subsampling ||
+        band_height != cached.band_height) {
+        // nothing cached can be used for another source
+        this->bands.clear();
+        this->band_source = {source, width, height, this->quality, subsampling, band_height};
+    }
+    size_t number_of_bands = (height + band_height - 1) / band_height;
+    if (this->bands.size() != number_of_bands) {
+        this->bands.assign(number_of_bands, band_t{{}, 0, 0, false});
+    }
+    std::vector<size_t> dirty;
+    for (size_t i = 0; i < number_of_bands; i++) {
+        if (!this->bands[i].valid) {
+            dirty.push_back(i);
+            this->get_compressor(i + 1);
+        }
+    }
+    int mcu_height = band_height / RST_CYCLE;
+    std::function<void(size_t)> compress_band = [&](size_t d) {
+        size_t i = dirty[d];
+        band_t &band = this->bands[i];
+        int y = i * band_height;
+        int rows = std::min(band_height, height - y);
+        // a restart marker after every MCU row lets the bands be joined at their boundaries
+        band.valid = this->compressors[i + 1]->compress(source, y, width, rows,
+                                                        this->quality, subsampling, 1, band.buf) &&
+            this->find_segment(band, (rows + mcu_height - 1) / mcu_height);
+    };
+    if (this->threads > 1 && dirty.size() > 1) {
+        if (!this->pool) {
+            this->pool.reset(new thread_pool(this->threads));
+        }
+        this->pool->run(dirty.size(), compress_band);
+    } else {
+        for (size_t d = 0; d < dirty.size(); d++) {
+            compress_band(d);
+        }
+    }
+    for (size_t d = 0; d < dirty.size(); d++) {
+        if (!this->bands[dirty[d]].valid) {
+            this->error = this->compressors[dirty[d] + 1]->get_error();
+            if (this->error.empty()) {
+                this->error = "unexpected markers in a band";
+            }
+            this->invalidate_all();
+            return false;
+        }
+    }
+    this->join_bands(height, out);
+    return true;
+}
+
+bool jpeg_encoder::find_segment(band_t &band, int mcu_rows)
+{
+    const std::vector<uint8_t> &buf = band.buf;
+    if (buf.size() < 4 || buf[0] != MARKER_PREFIX || buf[1] != MARKER_SOI ||
+        buf[buf.size() - 2] != MARKER_PREFIX || buf[buf.size() - 1] != MARKER_EOI) {
+        return false;
+    }
+    // markers with a length up to the start of scan, then the segment up to EOI
+    size_t position = 2;
+    while (true) {
+        if (position + 4 > buf.size() || buf[position] != MARKER_PREFIX) {
+            return false;
+        }
+        uint8_t marker = buf[position + 1];
+        position += 2 + ((buf[position + 2] << 8) | buf[position + 3]);
+        if (marker == MARKER_SOS) {
+            break;
+        }
+    }
+    band.segment_begin = position;
+    band.segment_end = buf.size() - 2;
+    // 0xff in the segment is always followed by 0x00 or a restart marker
+    int restarts = 0;
+    const uint8_t *data = buf.data() + band.segment_begin;
+    const uint8_t *end = buf.data() + band.segment_end;
+    while ((data = (const uint8_t *)memchr(data, MARKER_PREFIX, end - data)) != NULL && data + 1 < end) {
+        if (data[1] >= MARKER_RST0 && data[1] <= MARKER_RST7) {
+            restarts++;
+        }
+        data += 2;
+    }
+    return restarts == mcu_rows - 1;
+}
+
+void jpeg_encoder::join_bands(uint16_t height, std::vector<uint8_t> &out)
+{
+    // the headers of the first band with the height of the whole frame,
+    // then the segments with the last restart marker of the cycle in between
+    const std::vector<uint8_t> &first = this->bands[0].buf;
+    out.assign(first.begin(), first.begin() + this->bands[0].segment_begin);
+    for (size_t position = 2; position < out.size(); position += 2 + ((out[position + 2] << 8) | out[position + 3])) {
+        if (out[position + 1] == MARKER_SOF0) {
+            // SOF0: marker, length, precision, then the height
+            out[position + 5] = height >> 8;
+            out[position + 6] = height & 0xff;
+            break;
+        }
+    }
+    for (size_t i = 0; i < this->bands.size(); i++) {
+        const band_t &band = this->bands[i];
+        if (i > 0) {
+            out.push_back(MARKER_PREFIX);
+            out.push_back(MARKER_RST7);
+        }
+        out.insert(out.end(), band.buf.begin() + band.segment_begin, band.buf.begin() + band.segment_end);
+    }
+    out.push_back(MARKER_PREFIX);
+    out.push_back(MARKER_EOI);
+}
+
+//// compressor /////
+
+static void set_sampling(j_compress_ptr cinfo, jpeg_encoder::subsampling_t subsampling)
+{
+    // Cb and Cr are 1x1 in the defaults, Y is 2x2 for 4:2:0
+    int factor = (subsampling == ycbcr_planes::SUBSAMPLING_420) ? 2 : 1;
+    cinfo->comp_info[0].h_samp_factor = factor;
+    cinfo->comp_info[0].v_samp_factor = factor;
+}
+
+jpeg_encoder::compressor::compressor()
+{
+    this->cinfo.err = jpeg_std_error(&this->error.pub);
+    this->error.pub.error_exit = error_exit;
+    this->error.pub.output_message = output_message;
+    this->error.message[0] = '\0';
+    jpeg_create_compress(&this->cinfo);
+    this->destination.pub.init_destination = init_destination;
+    this->destination.pub.empty_output_buffer = empty_output_buffer;
+    this->destination.pub.term_destination = term_destination;
+    this->destination.buf = NULL;
+    this->cinfo.dest = &this->destination.pub;
+}
+
+jpeg_encoder::compressor::~compressor()
+{
+    jpeg_destroy_compress(&this->cinfo);
+}
+
+bool jpeg_encoder::compressor::compress(const row_source_t &source, uint16_t y, uint16_t width, uint16_t height,
+                                        int quality, subsampling_t subsampling, int restart_in_rows, std::vector<uint8_t> &out)
+{
+    this->destination.buf = &out;
+    // libjpeg reports errors by error_exit(), which jumps back here
+    if (setjmp(this->error.jump)) {
+        jpeg_abort_compress(&this->cinfo);
+        out.clear();
+        return false;
+    }
+    this->cinfo.image_width = width;
+    this->cinfo.image_height = height;
+    this->cinfo.input_components = 3;
+    this->cinfo.in_color_space = (source.planes != NULL) ? JCS_YCbCr : JCS_EXT_BGR;
+    jpeg_set_defaults(&this->cinfo);
+    jpeg_set_quality(&this->cinfo, quality, TRUE);
+    set_sampling(&this->cinfo, subsampling);
+    this->cinfo.restart_in_rows = restart_in_rows;
+    this->cinfo.raw_data_in = (source.planes != NULL);
+    jpeg_start_compress(&this->cinfo, TRUE);
+    if (source.planes != NULL) {
+        // an MCU row of Y and of Cb and Cr at once, 16 and 8 rows for 4:2:0 or 8 each for 4:4:4,
+        // the planes are padded to whole MCUs
+        int chroma_size = (subsampling == ycbcr_planes::SUBSAMPLING_420) ? 2 : 1;
+        int mcu_rows = DCTSIZE * chroma_size;
+        JSAMPROW luma[MCU_ROWS], cb[MCU_ROWS], cr[MCU_ROWS];
+        JSAMPARRAY components[3] = {luma, cb, cr};
+        while (this->cinfo.next_scanline < this->cinfo.image_height) {
+            JDIMENSION row = y + this->cinfo.next_scanline;
+            for (int i = 0; i < mcu_rows; i++) {
+                luma[i] = (JSAMPROW)source.planes->get_row(0, row + i);
+            }
+            for (int i = 0; i < mcu_rows / chroma_size; i++) {
+                cb[i] = (JSAMPROW)source.planes->get_row(1, row / chroma_size + i);
+                cr[i] = (JSAMPROW)source.planes->get_row(2, row / chroma_size + i);
+            }
+            jpeg_write_raw_data(&this->cinfo, components, mcu_rows);
+        }
+        jpeg_finish_compress(&this->cinfo);
+        return true;
+    }
+    JSAMPROW rows[ROWS_PER_WRITE];
+    while (this->cinfo.next_scanline < this->cinfo.image_height) {
+        JDIMENSION row = y + this->cinfo.next_scanline;
+        int count = std::min<JDIMENSION>(ROWS_PER_WRITE, height - this->cinfo.next_scanline);
+        for (int i = 0; i < count; i++) {
+            rows[i] = (JSAMPROW)(source.pixels + source.stride * (row + i));
+        }
+        jpeg_write_scanlines(&this->cinfo, rows, count);
+    }
+    jpeg_finish_compress(&this->cinfo);
+    return true;
+}
+
+int jpeg_encoder::compressor::get_mcu_height(subsampling_t subsampling)
+{
+    if (setjmp(this->error.jump)) {
+        return DCTSIZE;
+    }
+    this->cinfo.in_color_space = JCS_RGB;
+    this->cinfo.input_components = 3;
+    jpeg_set_defaults(&this->cinfo);
+    set_sampling(&this->cinfo, subsampling);
+    // luminance has the largest sampling factor
+    return DCTSIZE * this->cinfo.comp_info[0].v_samp_factor;
+}
+
+void jpeg_encoder::compressor::error_exit(j_common_ptr cinfo)
+{
+    error_manager_t *error = (error_manager_t *)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, error->message);
+    longjmp(error->jump, 1);
+}
+
+void jpeg_encoder::compressor::output_message(j_common_ptr cinfo)
+{
+    // warnings are kept instead of going to stderr of the server
+    error_manager_t *error = (error_manager_t *)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, error->message);
+}
+
+void jpeg_encoder::compressor::init_destination(j_compress_ptr cinfo)
+{
+    destination_manager_t *destination = (destination_manager_t *)cinfo->dest;
+    std::vector<uint8_t> *buf = destination->buf;
+    // the whole capacity left by the previous frame is used without reallocation
+    buf->resize(std::max(buf->capacity(), INITIAL_OUTPUT_SIZE));
+    destination->pub.next_output_byte = buf->data();
+    destination->pub.free_in_buffer = buf->size();
+}
+
+boolean jpeg_encoder::compressor::empty_output_buffer(j_compress_ptr cinfo)
+{
+    destination_manager_t *destination = (destination_manager_t *)cinfo->dest;
+    std::vector<uint8_t> *buf = destination->buf;
+    // libjpeg calls this only when the buffer is full
+    size_t used = buf->size();
+    buf->resize(used * 2);
+    destination->pub.next_output_byte = buf->data() + used;
+    destination->pub.free_in_buffer = buf->size() - used;
+    return TRUE;
+}
+
+void jpeg_encoder::compressor::term_destination(j_compress_ptr cinfo)
+{
+    destination_manager_t *destination = (destination_manager_t *)cinfo->dest;
+    std::vector<uint8_t> *buf = destination->buf;
+    buf->resize(buf->size() - destination->pub.free_in_buffer);
+}
@@ -0,0 +1,132 @@
+#ifndef __JPEG_ENCODER_H__
+#define __JPEG_ENCODER_H__
+
+#include <bits/stdc++.h>
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+
+#include "thread_pool.h"
+#include "ycbcr_planes.h"
+
+// Compresses frames into JPEG with libjpeg compressors kept for the session.
+// Rows of BGR are read where they are,
+// or taken from YCbCr planes as raw data without the colour conversion of libjpeg,
+// and the output is written into a buffer which keeps its capacity for the next frame.
+// Chroma is sampled 4:2:0 by default, or 4:4:4 for sharper colour edges at a larger size.
+// A large frame is split into horizontal bands of 8 MCU rows with a restart marker after each MCU row.
+// Bands are compressed in parallel and their entropy-coded segments are kept,
+// so only the bands over the rows invalidated since the last frame are compressed again.
+// The segments are joined into one baseline JPEG, restart markers of a band need no renumbering
+// because their numbers cycle through 8 values.
+class jpeg_encoder
+{
+ public:
+    typedef ycbcr_planes::subsampling_t subsampling_t;
+    static const int DEFAULT_QUALITY = 95;
+ private:
+    // rows of BGR in place stride bytes apart, or planes of YCbCr
+    typedef struct row_source {
+        const uint8_t *pixels;
+        size_t stride;
+        const ycbcr_planes *planes;
+    } row_source_t;
+
+    // one libjpeg compressor, reused by every frame
+    class compressor
+    {
+     private:
+        typedef struct error_manager {
+            struct jpeg_error_mgr pub;
+            jmp_buf jump;
+            char message[JMSG_LENGTH_MAX];
+        } error_manager_t;
+        typedef struct destination_manager {
+            struct jpeg_destination_mgr pub;
+            std::vector<uint8_t> *buf;
+        } destination_manager_t;
+
+        struct jpeg_compress_struct cinfo;
+        error_manager_t error;
+        destination_manager_t destination;
+
+        static void error_exit(j_common_ptr cinfo);
+        static void output_message(j_common_ptr cinfo);
+        static void init_destination(j_compress_ptr cinfo);
+        static boolean empty_output_buffer(j_compress_ptr cinfo);
+        static void term_destination(j_compress_ptr cinfo);
+     public:
+        compressor();
+        ~compressor();
+        compressor(const compressor &) = delete;
+        compressor &operator=(const compressor &) = delete;
+        // restart_in_rows is 0 for no restart markers
+        // height rows of the source from y
+        bool compress(const row_source_t &source, uint16_t y, uint16_t width, uint16_t height,
+                      int quality, subsampling_t subsampling, int restart_in_rows, std::vector<uint8_t> &out);
+        // height of an MCU row with the subsampling
+        int get_mcu_height(subsampling_t subsampling);
+        const char *get_error() const { return this->error.message; };
+    };
+
+    typedef struct band {
+        // a JPEG of the band alone, and its entropy-coded segment in it
+        std::vector<uint8_t> buf;
+        size_t segment_begin;
+        size_t segment_end;
+        bool valid;
+    } band_t;
+    // what the bands were compressed from
+    typedef struct band_source {
+        row_source_t rows;
+        uint16_t width;
+        uint16_t height;
+        int quality;
+        subsampling_t subsampling;
+        int band_height;
+    } band_source_t;
+
+    int quality = DEFAULT_QUALITY;
+    subsampling_t subsampling = ycbcr_planes::SUBSAMPLING_420;
+    int threads = 1;
+    // [0] compresses whole frames, and every band has its own
+    std::vector<std::unique_ptr<compressor>> compressors;
+    std::vector<band_t> bands;
+    band_source_t band_source = {};
+    std::unique_ptr<thread_pool> pool;
+    std::string error;
+
+    compressor *get_compressor(size_t index);
+    bool encode_rows(const row_source_t &source, uint16_t width, uint16_t height, std::vector<uint8_t> &out);
+    bool encode_bands(const row_source_t &source, uint16_t width, uint16_t height,
+                      subsampling_t subsampling, int band_height, std::vector<uint8_t> &out);
+    bool find_segment(band_t &band, int mcu_rows);
+    void join_bands(uint16_t height, std::vector<uint8_t> &out);
+ public:
+    jpeg_encoder();
+    // compressors and threads are not shared, a copy only takes over the settings
+    jpeg_encoder(const jpeg_encoder &other);
+    jpeg_encoder &operator=(const jpeg_encoder &other);
+    // rows of BGR are stride bytes apart, out is resized to the JPEG and keeps its capacity.
+    // the rows changed since the last call have to be invalidated before it.
+    bool encode(const uint8_t *pixels, uint16_t width, uint16_t height, size_t stride, std::vector<uint8_t> &out);
+    // planes in their own subsampling, whatever set_subsampling() says
+    bool encode(const ycbcr_planes &planes, std::vector<uint8_t> &out);
+    // rows changed since the last encode(), the bands over them are compressed again
+    void invalidate(uint16_t y, uint16_t height);
+    void invalidate_all() { this->bands.clear(); };
+
+    void set_quality(int quality) { this->quality = std::max(1, std::min(100, quality)); };
+    int get_quality() const { return this->quality; };
+    // subsampling of the rows of pixels
+    void set_subsampling(subsampling_t subsampling) { this->subsampling = subsampling; };
+    subsampling_t get_subsampling() const { return this->subsampling; };
+    // number of bands compressed at once, 1 for no parallel encoding
+    void set_threads(int threads);
+    int get_threads() const { return this->threads; };
+    // message of libjpeg for the last failure
+    const std::string get_error() const { return this->error; };
+};
+
+#endif
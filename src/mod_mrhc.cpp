@@ -41,20 +41,58 @@
 #include <vector>
 
 #include "ap_config.h"
+#include "apr_strings.h"
 
 #include "mrhc_common.h"
 #include "vnc_client.h"
 
 extern "C" module AP_MODULE_DECLARE_DATA mrhc_module;
 
-static bool mrhc_spin(vnc_client *client, request_rec *r);
+// a directive not set in the directory nor above it, its default is used
+static const int UNSET = -1;
+// the pixel format of the server as it is, converted here
+static const int CAPTURE_DEPTH_NATIVE = 0;
+// 32bpp true colour set by SetPixelFormat, as mrhc always asked for
+static const int DEFAULT_CAPTURE_DEPTH = 32;
+
+// UNSET or NULL for the directives not set, they are taken from the parent directory by mrhc_merge_dir_config()
+typedef struct mrhc_dir_config {
+    // bits per pixel to capture, CAPTURE_DEPTH_NATIVE for the pixel format of the server
+    int capture_depth;
+    // 8bpp indexes of the colour map instead of true colour
+    int colour_map;
+    // int32_t encoding types to advertise in order, NULL for the defaults of vnc_client
+    apr_array_header_t *encoding_types;
+    // threads to compress a frame with, 0 for the number of cores
+    int encoder_threads;
+    // image_format_t to answer with in order of preference, NULL for JPEG only
+    apr_array_header_t *image_formats;
+    int jpeg_quality;
+    int webp_quality;
+    int png_compression;
+    // milliseconds to deliver a JPEG frame, 0 for the fixed quality
+    int frame_budget;
+} mrhc_dir_config_t;
+
+static bool mrhc_spin(vnc_client *client, const mrhc_dir_config_t *conf, request_rec *r);
 static bool mrhc_confirm(request_rec *r);
-static bool mrhc_throw(vnc_client *client, request_rec *r);
+static bool mrhc_throw(vnc_client *client, const mrhc_dir_config_t *conf, request_rec *r);
+static image_format_t mrhc_negotiate(const request_rec *r, const mrhc_dir_config_t *conf);
+static bool mrhc_accepts(const request_rec *r, const std::string content_type);
+static const char *mrhc_content_type(image_format_t image_format);
 static const vnc_operation_t mrhc_query(const request_rec *r);
+static bool mrhc_has_param(const request_rec *r, const std::string name);
+static bool mrhc_get_param(const request_rec *r, const std::string name, std::string *value);
+static double mrhc_scale(const request_rec *r, const vnc_client *client);
+static const std::string mrhc_scale_query(const request_rec *r);
+static bool mrhc_cursor(const vnc_client *client, request_rec *r);
+static bool mrhc_pointer(const vnc_client *client, request_rec *r);
 static const std::string mrhc_html(const request_rec *r, const vnc_client *client);
 static const std::string mrhc_error(const request_rec *r, const std::string message);
 static apr_status_t ap_get_vnc_param_by_basic_auth_components(const request_rec *r, char *host, int *port, char *password);
 static std::vector<std::string> split_string(std::string s, std::string delim);
+static std::string trim_string(std::string s);
+static int conf_value(int value, int default_value);
 
 // TODO: Need to support multi process but only support single process for now
 vnc_client *client_cache = NULL;
@@ -92,7 +130,8 @@ static int mrhc_handler(request_rec *r)
 
             LOGGER_DEBUG("Start VNC Client");
             vnc_client *client = new vnc_client(host, port, password);
-            if (!mrhc_spin(client, r)) {
+            const mrhc_dir_config_t *conf = (const mrhc_dir_config_t *)ap_get_module_config(r->per_dir_config, &mrhc_module);
+            if (!mrhc_spin(client, conf, r)) {
                 ap_rputs(mrhc_error(r, "failed to mrhc, please try again.").c_str(), r);
             }
             client_cache = client;
@@ -115,16 +154,17 @@ static int mrhc_handler(request_rec *r)
     // mrhc is already spinning, ready to throw it.
     LOGGER_DEBUG("VNC Client is already running.");
 
-    if (!mrhc_throw(client_cache, r)) {
+    const mrhc_dir_config_t *conf = (const mrhc_dir_config_t *)ap_get_module_config(r->per_dir_config, &mrhc_module);
+    if (!mrhc_throw(client_cache, conf, r)) {
         apr_table_set(r->err_headers_out, "WWW-Authenticate", "Basic real=\"\"");
         return HTTP_UNAUTHORIZED;
     }
     return OK;
 }
 
-static bool mrhc_spin(vnc_client *client, request_rec *r)
+static bool mrhc_spin(vnc_client *client, const mrhc_dir_config_t *conf, request_rec *r)
 {
-    if (client == NULL || r == NULL) {
+    if (client == NULL || conf == NULL || r == NULL) {
         LOGGER_DEBUG("Invalid arguments.");
         return false;
     }
@@ -136,11 +176,33 @@ static bool mrhc_spin(vnc_client *client, request_rec *r)
         LOGGER_DEBUG("Failed to authenticate.");
         return false;
     }
+    // the native pixel format is converted here rather than on the server
+    int capture_depth = conf_value(conf->capture_depth, DEFAULT_CAPTURE_DEPTH);
+    client->set_native_pixel_format(capture_depth == CAPTURE_DEPTH_NATIVE);
+    client->set_colour_map(conf->colour_map);
+    if (capture_depth != CAPTURE_DEPTH_NATIVE && !client->set_capture_depth(capture_depth)) {
+        LOGGER_DEBUG("Failed to set_capture_depth.");
+        return false;
+    }
+    int encoder_threads = conf_value(conf->encoder_threads, 0);
+    if (encoder_threads == 0) {
+        encoder_threads = std::thread::hardware_concurrency();
+    }
+    client->set_encoder_threads(encoder_threads);
+    client->set_jpeg_quality(conf_value(conf->jpeg_quality, jpeg_encoder::DEFAULT_QUALITY));
+    client->set_webp_quality(conf_value(conf->webp_quality, vnc_client::DEFAULT_WEBP_QUALITY));
+    client->set_png_compression(conf_value(conf->png_compression, vnc_client::DEFAULT_PNG_COMPRESSION));
+    client->set_frame_budget(conf_value(conf->frame_budget, 0));
+    if (conf->encoding_types != NULL) {
+        const int32_t *encoding_types = (const int32_t *)conf->encoding_types->elts;
+        client->set_encoding_types(std::vector<int32_t>(encoding_types, encoding_types + conf->encoding_types->nelts));
+    }
     if (!client->configure()) {
         LOGGER_DEBUG("Failed to configure.");
         return false;
     }
     // return initial html page with url and image size
+    client->set_image_scale(mrhc_scale(r, client));
     r->content_type = "text/html";
     ap_rputs(mrhc_html(r, client).c_str(), r);
     return true;
@@ -164,14 +226,22 @@ static bool mrhc_confirm(request_rec *r)
     return true;
 }
 
-static bool mrhc_throw(vnc_client *client, request_rec *r)
+static bool mrhc_throw(vnc_client *client, const mrhc_dir_config_t *conf, request_rec *r)
 {
-    if (client == NULL || r == NULL) {
+    if (client == NULL || conf == NULL || r == NULL) {
         LOGGER_DEBUG("Invalid arguments.");
         return false;
     }
+    // cursor is drawn by the browser apart from the screen
+    if (mrhc_has_param(r, "cursor")) {
+        return mrhc_cursor(client, r);
+    }
+    if (mrhc_has_param(r, "pointer")) {
+        return mrhc_pointer(client, r);
+    }
     vnc_operation_t operation = vnc_operation_t{};
-    if (r->parsed_uri.query) {
+    // a query of only format= operates nothing
+    if (mrhc_has_param(r, "x") || mrhc_has_param(r, "y") || mrhc_has_param(r, "k")) {
         operation = mrhc_query(r);
         if (!client->operate(operation)) {
             LOGGER_DEBUG("Failed to operate.");
@@ -180,21 +250,96 @@ static bool mrhc_throw(vnc_client *client, request_rec *r)
         // wait for the operation to be reflected
         sleep(1);
     }
+    image_format_t image_format = mrhc_negotiate(r, conf);
+    client->set_image_format(image_format);
+    client->set_image_scale(mrhc_scale(r, client));
     if (!client->capture(operation)) {
         LOGGER_DEBUG("Failed to capture.");
         return false;
     }
-    std::vector<uint8_t> jpeg_buf = client->get_jpeg_buf();
-    LOGGER_DEBUG("jpeg size:%d",jpeg_buf.size());
-    char jpeg[jpeg_buf.size()] = {};
-    for (unsigned int i = 0; i < jpeg_buf.size(); i++) {
-        jpeg[i] = jpeg_buf[i];
-    }
-    r->content_type = "image/jpeg";
-    ap_rwrite(jpeg, jpeg_buf.size(), r);
+    std::vector<uint8_t> image_buf = client->get_image_buf();
+    r->content_type = mrhc_content_type(image_format);
+    LOGGER_DEBUG("%s size:%d", r->content_type, image_buf.size());
+    // the format depends on Accept, caches must not mix them up
+    apr_table_mergen(r->headers_out, "Vary", "Accept");
+    // the time until the brigade is flushed to the client tells how fast the link is
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ap_rwrite(image_buf.data(), image_buf.size(), r);
+    ap_rflush(r);
+    std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    client->report_delivery(image_buf.size(), elapsed.count());
     return true;
 }
 
+static image_format_t mrhc_negotiate(const request_rec *r, const mrhc_dir_config_t *conf)
+{
+    std::vector<image_format_t> image_formats = {IMAGE_FORMAT_JPEG};
+    if (conf->image_formats != NULL) {
+        const image_format_t *elts = (const image_format_t *)conf->image_formats->elts;
+        image_formats.assign(elts, elts + conf->image_formats->nelts);
+    }
+    // format= chooses one of the offered formats whatever Accept says
+    std::string name;
+    image_format_t requested = IMAGE_FORMAT_JPEG;
+    if (mrhc_get_param(r, "format", &name) && vnc_client::parse_image_format(name, &requested) &&
+        std::find(image_formats.begin(), image_formats.end(), requested) != image_formats.end()) {
+        return requested;
+    }
+    for (unsigned int i = 0; i < image_formats.size(); i++) {
+        if (mrhc_accepts(r, mrhc_content_type(image_formats[i]))) {
+            return image_formats[i];
+        }
+    }
+    // every browser shows JPEG
+    return IMAGE_FORMAT_JPEG;
+}
+
+static bool mrhc_accepts(const request_rec *r, const std::string content_type)
+{
+    const char *accept = apr_table_get(r->headers_in, "Accept");
+    if (accept == NULL) {
+        return true;
+    }
+    // the most specific media range decides, q=0 refuses.
+    // media types and the names of parameters are case-insensitive
+    std::string any_subtype = content_type.substr(0, content_type.find('/')) + "/*";
+    int specificity = -1;
+    bool accepted = false;
+    std::vector<std::string> ranges = split_string(accept, ",");
+    for (unsigned int i = 0; i < ranges.size(); i++) {
+        std::vector<std::string> params = split_string(ranges[i], ";");
+        std::string range = trim_string(params[0]);
+        int s = (strcasecmp(range.c_str(), content_type.c_str()) == 0) ? 2 :
+            (strcasecmp(range.c_str(), any_subtype.c_str()) == 0) ? 1 : (range == "*/*") ? 0 : -1;
+        if (s <= specificity) {
+            continue;
+        }
+        double quality = 1.0;
+        for (unsigned int j = 1; j < params.size(); j++) {
+            std::vector<std::string> param = split_string(params[j], "=");
+            if (param.size() == 2 && strcasecmp(trim_string(param[0]).c_str(), "q") == 0) {
+                quality = atof(trim_string(param[1]).c_str());
+            }
+        }
+        specificity = s;
+        accepted = quality > 0;
+    }
+    return accepted;
+}
+
+static const char *mrhc_content_type(image_format_t image_format)
+{
+    switch (image_format) {
+    case IMAGE_FORMAT_WEBP:
+    case IMAGE_FORMAT_WEBP_LOSSLESS:
+        return "image/webp";
+    case IMAGE_FORMAT_PNG:
+        return "image/png";
+    default:
+        return "image/jpeg";
+    }
+}
+
 static const vnc_operation_t mrhc_query(const request_rec *r)
 {
     vnc_operation_t op = vnc_operation_t{};
@@ -214,6 +359,124 @@ static const vnc_operation_t mrhc_query(const request_rec *r)
     return op;
 }
 
+static bool mrhc_has_param(const request_rec *r, const std::string name)
+{
+    if (r->parsed_uri.query == NULL) {
+        return false;
+    }
+    std::vector<std::string> pairs = split_string(r->parsed_uri.query, "&");
+    for (unsigned int i = 0; i < pairs.size(); i++) {
+        if (split_string(pairs[i], "=")[0] == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool mrhc_get_param(const request_rec *r, const std::string name, std::string *value)
+{
+    if (r->parsed_uri.query == NULL) {
+        return false;
+    }
+    std::vector<std::string> pairs = split_string(r->parsed_uri.query, "&");
+    for (unsigned int i = 0; i < pairs.size(); i++) {
+        std::vector<std::string> param = split_string(pairs[i], "=");
+        if (param[0] == name && param.size() > 1) {
+            *value = param[1];
+            return true;
+        }
+    }
+    return false;
+}
+
+// scale= shrinks the frame by the factor, w= and h= fit it in the width and the height.
+// the smallest of them wins and the frame is never enlarged.
+static double mrhc_scale(const request_rec *r, const vnc_client *client)
+{
+    double scale = 1.0;
+    std::string value;
+    if (mrhc_get_param(r, "scale", &value) && atof(value.c_str()) > 0) {
+        scale = std::min(scale, atof(value.c_str()));
+    }
+    if (mrhc_get_param(r, "w", &value) && atoi(value.c_str()) > 0 && client->get_width() > 0) {
+        scale = std::min(scale, (double)atoi(value.c_str()) / client->get_width());
+    }
+    if (mrhc_get_param(r, "h", &value) && atoi(value.c_str()) > 0 && client->get_height() > 0) {
+        scale = std::min(scale, (double)atoi(value.c_str()) / client->get_height());
+    }
+    return scale;
+}
+
+// the params of the scale to pass on to every image of the page, each followed by &.
+// they are written from the parsed numbers, never copied from the request into the page.
+static const std::string mrhc_scale_query(const request_rec *r)
+{
+    std::string query = "";
+    std::string value;
+    if (mrhc_get_param(r, "scale", &value) && atof(value.c_str()) > 0) {
+        query += "scale=" + std::to_string(atof(value.c_str())) + "&";
+    }
+    if (mrhc_get_param(r, "w", &value) && atoi(value.c_str()) > 0) {
+        query += "w=" + std::to_string(atoi(value.c_str())) + "&";
+    }
+    if (mrhc_get_param(r, "h", &value) && atoi(value.c_str()) > 0) {
+        query += "h=" + std::to_string(atoi(value.c_str())) + "&";
+    }
+    return query;
+}
+
+// the path of the page without the query, to be put in html attributes and js strings quoted by '.
+// it is taken still percent-encoded and any other byte which could end the quote is encoded too.
+static const std::string mrhc_page_path(const request_rec *r)
+{
+    std::string unparsed_uri = r->unparsed_uri;
+    std::string path = unparsed_uri.substr(0, unparsed_uri.find('?'));
+    std::string escaped = "";
+    for (unsigned int i = 0; i < path.size(); i++) {
+        unsigned char c = path[i];
+        if (isalnum(c) || strchr("/-._~%", c) != NULL) {
+            escaped += c;
+        } else {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            escaped += hex;
+        }
+    }
+    return escaped;
+}
+
+static bool mrhc_cursor(const vnc_client *client, request_rec *r)
+{
+    std::vector<uint8_t> png = client->get_cursor_png();
+    LOGGER_DEBUG("cursor png size:%d", png.size());
+    if (png.empty()) {
+        r->status = HTTP_NO_CONTENT;
+        return true;
+    }
+    r->content_type = "image/png";
+    ap_rwrite(png.data(), png.size(), r);
+    return true;
+}
+
+static bool mrhc_pointer(const vnc_client *client, request_rec *r)
+{
+    vnc_cursor_t cursor = client->get_cursor();
+    std::string json = "{"
+        "\"x\":" + std::to_string(client->get_pointer_x()) + ","
+        "\"y\":" + std::to_string(client->get_pointer_y()) + ","
+        "\"hotspot_x\":" + std::to_string(cursor.hotspot_x) + ","
+        "\"hotspot_y\":" + std::to_string(cursor.hotspot_y) + ","
+        "\"width\":" + std::to_string(cursor.width) + ","
+        "\"height\":" + std::to_string(cursor.height) + ","
+        "\"sequence\":" + std::to_string(cursor.sequence) + ","
+        "\"frame_width\":" + std::to_string(client->get_width()) + ","
+        "\"frame_height\":" + std::to_string(client->get_height()) + "}";
+    LOGGER_DEBUG(json);
+    r->content_type = "application/json";
+    ap_rputs(json.c_str(), r);
+    return true;
+}
+
 static const std::string mrhc_html(const request_rec *r, const vnc_client *client)
 {
     std::string html = "";
@@ -221,9 +484,13 @@ static const std::string mrhc_html(const request_rec *r, const vnc_client *clien
         return html;
     }
     std::string hostname = r->hostname;
-    std::string path = r->unparsed_uri;
-    std::string width = std::to_string(client->get_width());
-    std::string height = std::to_string(client->get_height());
+    std::string path = mrhc_page_path(r);
+    // the image is scaled, clicks and the cursor are in the frame buffer
+    std::string query = mrhc_scale_query(r);
+    std::string width = std::to_string(client->get_image_width());
+    std::string height = std::to_string(client->get_image_height());
+    std::string frame_width = std::to_string(client->get_width());
+    std::string frame_height = std::to_string(client->get_height());
     html ="\
 <html>                                                                  \
   <head>                                                                \
@@ -234,20 +501,59 @@ static const std::string mrhc_html(const request_rec *r, const vnc_client *clien
       <input type='hidden' name='logout' value='1'>                     \
       <input type='submit' value='logout'>                              \
     </form>                                                             \
-    <image id='mrhc' src='http://" + hostname + path + "' width='" + width + "' height='" + height + "'> \
+    <div style='position: relative; display: inline-block;'>            \
+      <image id='mrhc' src='http://" + hostname + path + "?" + query + "' width='" + width + "' height='" + height + "'> \
+      <image id='cursor' style='position: absolute; pointer-events: none; display: none;'> \
+      <svg id='marker' width='9' height='9' style='position: absolute; pointer-events: none; display: none;'> \
+        <path d='M0 0L9 9M9 0L0 9' stroke='black' stroke-width='2'/>    \
+      </svg>                                                            \
+    </div>                                                              \
   </body>                                                               \
   <script src='https://ajax.googleapis.com/ajax/libs/jquery/3.4.1/jquery.min.js'></script> \
   <script type=text/javascript>                                         \
     let fetchLatestImage = () => {                                      \
-      $('#mrhc').attr('src', 'http://" + hostname + path + "?t=' + Date.now()); \
+      $('#mrhc').attr('src', 'http://" + hostname + path + "?" + query + "t=' + Date.now()); \
     };                                                                  \
     let timer = setInterval(fetchLatestImage, 5000);                    \
+    let cursorSequence = 0;                                             \
+    let frameWidth = " + frame_width + ";                               \
+    let frameHeight = " + frame_height + ";                             \
+    let ratio = () => $('#mrhc')[0].naturalWidth / frameWidth || 1;     \
+    let fetchPointer = () => {                                          \
+      $.getJSON('http://" + hostname + path + "?pointer&t=' + Date.now(), (p) => { \
+        frameWidth = p.frame_width;                                     \
+        frameHeight = p.frame_height;                                   \
+        if (p.x == 0 && p.y == 0) {                                     \
+          $('#cursor').hide();                                          \
+          $('#marker').hide();                                          \
+          return;                                                       \
+        }                                                               \
+        if (p.width == 0) {                                             \
+          $('#cursor').hide();                                          \
+          $('#marker').css({left: p.x * ratio() - 4, top: p.y * ratio() - 4}).show(); \
+          return;                                                       \
+        }                                                               \
+        $('#marker').hide();                                            \
+        if (p.sequence != cursorSequence) {                             \
+          cursorSequence = p.sequence;                                  \
+          $('#cursor').attr('src', 'http://" + hostname + path + "?cursor&t=' + p.sequence); \
+        }                                                               \
+        $('#cursor').css({                                              \
+          left: (p.x - p.hotspot_x) * ratio(), top: (p.y - p.hotspot_y) * ratio(), \
+          width: p.width * ratio(), height: p.height * ratio(),         \
+        }).show();                                                      \
+      });                                                               \
+    };                                                                  \
+    $('#mrhc').on('load', (e) => {                                      \
+      $('#mrhc').attr('width', e.target.naturalWidth).attr('height', e.target.naturalHeight); \
+      fetchPointer();                                                   \
+    });                                                                 \
     $('#mrhc').on('click', (e) => {                                     \
-      $('#mrhc').attr('src', 'http://" + hostname + path + "?x=' + e.offsetX + '&y=' + e.offsetY + '&b=0'); \
+      $('#mrhc').attr('src', 'http://" + hostname + path + "?" + query + "x=' + Math.round(e.offsetX / ratio()) + '&y=' + Math.round(e.offsetY / ratio()) + '&b=0'); \
       clearInterval(timer);                                             \
       timer = setInterval(fetchLatestImage, 5000);                      \
     }).on('contextmenu', (e) => {                                       \
-      $('#mrhc').attr('src', 'http://" + hostname + path + "?x=' + e.offsetX + '&y=' + e.offsetY + '&b=2'); \
+      $('#mrhc').attr('src', 'http://" + hostname + path + "?" + query + "x=' + Math.round(e.offsetX / ratio()) + '&y=' + Math.round(e.offsetY / ratio()) + '&b=2'); \
       clearInterval(timer);                                             \
       timer = setInterval(fetchLatestImage, 5000);                      \
       return false;                                                     \
@@ -256,7 +562,7 @@ static const std::string mrhc_html(const request_rec *r, const vnc_client *clien
       $.ajax(                                                           \
         {                                                               \
           type: 'GET',                                                  \
-          url: 'http://" + hostname + path + "?k=' + e.key,             \
+          url: 'http://" + hostname + path + "?" + query + "k=' + e.key, \
         }                                                               \
       );                                                                \
     });                                                                 \
@@ -273,7 +579,7 @@ static const std::string mrhc_error(const request_rec *r, const std::string mess
         return html;
     }
     std::string hostname = r->hostname;
-    std::string path = r->unparsed_uri;
+    std::string path = mrhc_page_path(r);
     html ="\
 <html>                                                                  \
   <body>                                                                \
@@ -366,6 +672,190 @@ static std::vector<std::string> split_string(std::string s, std::string delim)
     return v;
 }
 
+static std::string trim_string(std::string s)
+{
+    size_t first = s.find_first_not_of(" \t");
+    if (first == std::string::npos) {
+        return "";
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+static int conf_value(int value, int default_value)
+{
+    return (value == UNSET) ? default_value : value;
+}
+
+static void *mrhc_create_dir_config(apr_pool_t *p, char *dir)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)apr_pcalloc(p, sizeof(mrhc_dir_config_t));
+    conf->capture_depth = UNSET;
+    conf->colour_map = 0;
+    conf->encoding_types = NULL;
+    conf->encoder_threads = UNSET;
+    conf->image_formats = NULL;
+    conf->jpeg_quality = UNSET;
+    conf->webp_quality = UNSET;
+    conf->png_compression = UNSET;
+    conf->frame_budget = UNSET;
+    return conf;
+}
+
+static void *mrhc_merge_dir_config(apr_pool_t *p, void *base_conf, void *new_conf)
+{
+    const mrhc_dir_config_t *base = (const mrhc_dir_config_t *)base_conf;
+    const mrhc_dir_config_t *add = (const mrhc_dir_config_t *)new_conf;
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)apr_pcalloc(p, sizeof(mrhc_dir_config_t));
+    // a directive set in the directory wins, the colour map goes with the depth
+    bool depth_set = (add->capture_depth != UNSET);
+    conf->capture_depth = depth_set ? add->capture_depth : base->capture_depth;
+    conf->colour_map = depth_set ? add->colour_map : base->colour_map;
+    // lists are replaced as a whole, not appended to the ones of the parent
+    conf->encoding_types = (add->encoding_types != NULL) ? add->encoding_types : base->encoding_types;
+    conf->encoder_threads = (add->encoder_threads != UNSET) ? add->encoder_threads : base->encoder_threads;
+    conf->image_formats = (add->image_formats != NULL) ? add->image_formats : base->image_formats;
+    conf->jpeg_quality = (add->jpeg_quality != UNSET) ? add->jpeg_quality : base->jpeg_quality;
+    conf->webp_quality = (add->webp_quality != UNSET) ? add->webp_quality : base->webp_quality;
+    conf->png_compression = (add->png_compression != UNSET) ? add->png_compression : base->png_compression;
+    conf->frame_budget = (add->frame_budget != UNSET) ? add->frame_budget : base->frame_budget;
+    return conf;
+}
+
+static const char *mrhc_set_capture_depth(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    conf->colour_map = 0;
+    if (strcasecmp(arg, "native") == 0) {
+        conf->capture_depth = CAPTURE_DEPTH_NATIVE;
+        return NULL;
+    }
+    if (strcasecmp(arg, "colourmap") == 0) {
+        conf->capture_depth = 8;
+        conf->colour_map = 1;
+        return NULL;
+    }
+    int capture_depth = atoi(arg);
+    if (capture_depth != 32 && capture_depth != 16 && capture_depth != 8) {
+        return "MrhcCaptureDepth must be one of native, 32, 16, 8 or colourmap";
+    }
+    conf->capture_depth = capture_depth;
+    return NULL;
+}
+
+static const char *mrhc_add_encoding(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    int32_t encoding_type = 0;
+    if (!vnc_client::parse_encoding_type(arg, &encoding_type)) {
+        return apr_psprintf(cmd->pool, "MrhcEncodings: unknown or not compiled in encoding '%s'", arg);
+    }
+    if (conf->encoding_types == NULL) {
+        conf->encoding_types = apr_array_make(cmd->pool, RFB_MAX_NUMBER_OF_ENCODINGS, sizeof(int32_t));
+    }
+    if (conf->encoding_types->nelts >= RFB_MAX_NUMBER_OF_ENCODINGS) {
+        return "MrhcEncodings: too many encodings";
+    }
+    *(int32_t *)apr_array_push(conf->encoding_types) = encoding_type;
+    return NULL;
+}
+
+static const char *mrhc_set_encoder_threads(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    if (strcasecmp(arg, "auto") == 0) {
+        conf->encoder_threads = 0;
+        return NULL;
+    }
+    int encoder_threads = atoi(arg);
+    if (encoder_threads < 1) {
+        return "MrhcEncoderThreads must be auto or a positive number";
+    }
+    conf->encoder_threads = encoder_threads;
+    return NULL;
+}
+
+static const char *mrhc_add_image_format(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    image_format_t image_format = IMAGE_FORMAT_JPEG;
+    if (!vnc_client::parse_image_format(arg, &image_format)) {
+        return apr_psprintf(cmd->pool, "MrhcImageFormats: unknown image format '%s'", arg);
+    }
+    if (conf->image_formats == NULL) {
+        conf->image_formats = apr_array_make(cmd->pool, 4, sizeof(image_format_t));
+    }
+    *(image_format_t *)apr_array_push(conf->image_formats) = image_format;
+    return NULL;
+}
+
+static const char *mrhc_set_jpeg_quality(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    int jpeg_quality = atoi(arg);
+    if (jpeg_quality < 1 || jpeg_quality > 100) {
+        return "MrhcJpegQuality must be 1 to 100";
+    }
+    conf->jpeg_quality = jpeg_quality;
+    return NULL;
+}
+
+static const char *mrhc_set_webp_quality(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    int webp_quality = atoi(arg);
+    if (webp_quality < 1 || webp_quality > 100) {
+        return "MrhcWebpQuality must be 1 to 100";
+    }
+    conf->webp_quality = webp_quality;
+    return NULL;
+}
+
+static const char *mrhc_set_png_compression(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    int png_compression = atoi(arg);
+    if (!isdigit(arg[0]) || png_compression > 9) {
+        return "MrhcPngCompression must be 0 (fastest) to 9 (smallest)";
+    }
+    conf->png_compression = png_compression;
+    return NULL;
+}
+
+static const char *mrhc_set_frame_budget(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    mrhc_dir_config_t *conf = (mrhc_dir_config_t *)cfg;
+    if (strcasecmp(arg, "off") == 0) {
+        conf->frame_budget = 0;
+        return NULL;
+    }
+    int frame_budget = atoi(arg);
+    if (frame_budget < 1) {
+        return "MrhcFrameBudget must be off or milliseconds";
+    }
+    conf->frame_budget = frame_budget;
+    return NULL;
+}
+
+static const command_rec mrhc_cmds[] = {
+    AP_INIT_TAKE1("MrhcCaptureDepth", (cmd_func)mrhc_set_capture_depth, NULL, ACCESS_CONF,
+                  "bits per pixel to capture: 32 (default), native, 16 (RGB565), 8 (BGR233) or colourmap (8bpp indexed)"),
+    AP_INIT_ITERATE("MrhcEncodings", (cmd_func)mrhc_add_encoding, NULL, ACCESS_CONF,
+                    "encodings and pseudo-encodings to advertise in order of preference, e.g. zrle tight raw quality=6"),
+    AP_INIT_TAKE1("MrhcEncoderThreads", (cmd_func)mrhc_set_encoder_threads, NULL, ACCESS_CONF,
+                  "threads to compress a large frame with in strips: auto (number of cores) or a number, 1 for no parallel encoding"),
+    AP_INIT_ITERATE("MrhcImageFormats", (cmd_func)mrhc_add_image_format, NULL, ACCESS_CONF,
+                    "image formats to offer in order of preference, the first one the browser accepts is sent: jpeg, webp, webp-lossless or png"),
+    AP_INIT_TAKE1("MrhcJpegQuality", (cmd_func)mrhc_set_jpeg_quality, NULL, ACCESS_CONF,
+                  "quality of JPEG, 1 to 100"),
+    AP_INIT_TAKE1("MrhcWebpQuality", (cmd_func)mrhc_set_webp_quality, NULL, ACCESS_CONF,
+                  "quality of lossy WebP, 1 to 100"),
+    AP_INIT_TAKE1("MrhcPngCompression", (cmd_func)mrhc_set_png_compression, NULL, ACCESS_CONF,
+                  "compression level of PNG, 0 (fastest) to 9 (smallest)"),
+    AP_INIT_TAKE1("MrhcFrameBudget", (cmd_func)mrhc_set_frame_budget, NULL, ACCESS_CONF,
+                  "milliseconds to deliver a JPEG frame, the quality and the subsampling follow the link: off (MrhcJpegQuality, default) or milliseconds"),
+    {NULL}
+};
+
 static void mrhc_register_hooks(apr_pool_t *p)
 {
     ap_hook_handler(mrhc_handler, NULL, NULL, APR_HOOK_MIDDLE);
@@ -375,11 +865,11 @@ extern "C" {
     /* Dispatch list for API hooks */
     module AP_MODULE_DECLARE_DATA mrhc_module = {
         STANDARD20_MODULE_STUFF,
-        NULL,                  /* create per-dir    config structures */
-        NULL,                  /* merge  per-dir    config structures */
+        mrhc_create_dir_config, /* create per-dir    config structures */
+        mrhc_merge_dir_config, /* merge  per-dir    config structures */
         NULL,                  /* create per-server config structures */
         NULL,                  /* merge  per-server config structures */
-        NULL,                  /* table of config file commands       */
+        mrhc_cmds,             /* table of config file commands       */
         mrhc_register_hooks  /* register hooks                      */
     };
 };
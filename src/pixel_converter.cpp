@@ -0,0 +1,293 @@
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_CONVERTER_X86
+#endif
+
+#include "pixel_converter.h"
+
+// colour value of max into 0-255, rounded
+template <uint16_t MAX>
+static inline uint8_t scale_colour(uint32_t value)
+{
+    return MAX == 0xff ? value : (value * 0xff + MAX / 2) / MAX;
+}
+
+template <uint8_t BITS_PER_PIXEL>
+static inline uint32_t swap_pixel(uint32_t pixel)
+{
+    return BITS_PER_PIXEL == 32 ? __builtin_bswap32(pixel)
+        : BITS_PER_PIXEL == 16 ? __builtin_bswap16(pixel) : pixel;
+}
+
+// shifts and maxes are constants, so are the masks and the scaling
+template <uint8_t BITS_PER_PIXEL, bool SWAP_BYTES,
+          uint16_t RED_MAX, uint16_t GREEN_MAX, uint16_t BLUE_MAX,
+          uint8_t RED_SHIFT, uint8_t GREEN_SHIFT, uint8_t BLUE_SHIFT>
+static void convert_row_fixed(const uint32_t *src, uint8_t *dst, size_t width)
+{
+    for (size_t x = 0; x < width; x++) {
+        uint32_t value = SWAP_BYTES ? swap_pixel<BITS_PER_PIXEL>(src[x]) : src[x];
+        dst[x * 3 + 0] = scale_colour<BLUE_MAX>((value >> BLUE_SHIFT) & BLUE_MAX);
+        dst[x * 3 + 1] = scale_colour<GREEN_MAX>((value >> GREEN_SHIFT) & GREEN_MAX);
+        dst[x * 3 + 2] = scale_colour<RED_MAX>((value >> RED_SHIFT) & RED_MAX);
+    }
+}
+
+typedef struct fixed_format {
+    uint8_t bits_per_pixel;
+    bool big_endian;
+    uint16_t red_max;
+    uint16_t green_max;
+    uint16_t blue_max;
+    uint8_t red_shift;
+    uint8_t green_shift;
+    uint8_t blue_shift;
+    pixel_converter::row_func_t row_func;
+} fixed_format_t;
+
+#define FIXED_FORMAT(bpp, big_endian, red_max, green_max, blue_max, red_shift, green_shift, blue_shift) \
+    {bpp, big_endian, red_max, green_max, blue_max, red_shift, green_shift, blue_shift,                 \
+     &convert_row_fixed<bpp, big_endian, red_max, green_max, blue_max, red_shift, green_shift, blue_shift>}
+
+// native formats servers commonly have
+static const fixed_format_t FIXED_FORMATS[] = {
+    // BGRX, RGBX
+    FIXED_FORMAT(32, false, 0xff, 0xff, 0xff, 16, 8, 0),
+    FIXED_FORMAT(32, false, 0xff, 0xff, 0xff, 0, 8, 16),
+    FIXED_FORMAT(32, true,  0xff, 0xff, 0xff, 16, 8, 0),
+    FIXED_FORMAT(32, true,  0xff, 0xff, 0xff, 0, 8, 16),
+    // RGB565
+    FIXED_FORMAT(16, false, 0x1f, 0x3f, 0x1f, 11, 5, 0),
+    FIXED_FORMAT(16, true,  0x1f, 0x3f, 0x1f, 11, 5, 0),
+    // RGB555
+    FIXED_FORMAT(16, false, 0x1f, 0x1f, 0x1f, 10, 5, 0),
+    FIXED_FORMAT(16, true,  0x1f, 0x1f, 0x1f, 10, 5, 0),
+    // BGR233
+    FIXED_FORMAT(8, false, 0x07, 0x07, 0x03, 0, 3, 6),
+};
+
+pixel_converter::pixel_converter()
+{
+    pixel_format_t pixel_format = {};
+    pixel_format.bits_per_pixel = 32;
+    pixel_format.depth = 24;
+    pixel_format.true_colour_flag = 1;
+    pixel_format.red_max = htons(0xff);
+    pixel_format.green_max = htons(0xff);
+    pixel_format.blue_max = htons(0xff);
+    pixel_format.red_shift = 16;
+    pixel_format.green_shift = 8;
+    pixel_format.blue_shift = 0;
+    this->set_pixel_format(pixel_format);
+}
+
+void pixel_converter::set_pixel_format(const pixel_format_t &pixel_format)
+{
+    this->bits_per_pixel = pixel_format.bits_per_pixel;
+    this->big_endian = pixel_format.big_endian_flag;
+    this->colour_map = !pixel_format.true_colour_flag;
+    this->red_max = ntohs(pixel_format.red_max);
+    this->green_max = ntohs(pixel_format.green_max);
+    this->blue_max = ntohs(pixel_format.blue_max);
+    this->red_shift = pixel_format.red_shift;
+    this->green_shift = pixel_format.green_shift;
+    this->blue_shift = pixel_format.blue_shift;
+
+    this->byte_aligned = !this->colour_map && pixel_format.bits_per_pixel == 32
+        && this->red_max == 0xff && this->green_max == 0xff && this->blue_max == 0xff
+        && this->red_shift % 8 == 0 && this->green_shift % 8 == 0 && this->blue_shift % 8 == 0
+        && this->red_shift <= 24 && this->green_shift <= 24 && this->blue_shift <= 24;
+    // pixels are kept in wire order, the most significant byte comes first in big endian
+    this->offsets[0] = this->big_endian ? 3 - this->blue_shift / 8 : this->blue_shift / 8;
+    this->offsets[1] = this->big_endian ? 3 - this->green_shift / 8 : this->green_shift / 8;
+    this->offsets[2] = this->big_endian ? 3 - this->red_shift / 8 : this->red_shift / 8;
+
+    this->fixed_row = NULL;
+    for (size_t i = 0; !this->colour_map && i < sizeof(FIXED_FORMATS) / sizeof(FIXED_FORMATS[0]); i++) {
+        const fixed_format_t &f = FIXED_FORMATS[i];
+        if (f.bits_per_pixel == this->bits_per_pixel && f.big_endian == this->big_endian
+            && f.red_max == this->red_max && f.green_max == this->green_max && f.blue_max == this->blue_max
+            && f.red_shift == this->red_shift && f.green_shift == this->green_shift && f.blue_shift == this->blue_shift) {
+            this->fixed_row = f.row_func;
+            break;
+        }
+    }
+    if (this->bits_per_pixel == 8 && !this->colour_map) {
+        this->build_lut();
+    }
+    this->select_fastest_kernel();
+}
+
+void pixel_converter::build_lut()
+{
+    uint32_t values[256];
+    for (int i = 0; i < 256; i++) {
+        values[i] = i;
+    }
+    this->convert_row_scalar(values, this->lut, 256);
+}
+
+void pixel_converter::select_fastest_kernel()
+{
+    this->kernel = KERNEL_SCALAR;
+    if (this->select_kernel(KERNEL_LUT)) {
+        return;
+    }
+    if (!this->select_kernel(KERNEL_AVX2) && !this->select_kernel(KERNEL_SSSE3)) {
+        this->select_kernel(KERNEL_FIXED);
+    }
+}
+
+bool pixel_converter::is_supported(kernel_t kernel)
+{
+    switch (kernel) {
+    case KERNEL_SCALAR:
+    case KERNEL_FIXED:
+    case KERNEL_LUT:
+        return true;
+#ifdef PIXEL_CONVERTER_X86
+    case KERNEL_SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+bool pixel_converter::select_kernel(kernel_t kernel)
+{
+    if (!is_supported(kernel)) {
+        return false;
+    }
+    if (kernel == KERNEL_FIXED && this->fixed_row == NULL) {
+        return false;
+    }
+    if (kernel == KERNEL_LUT && this->bits_per_pixel != 8) {
+        return false;
+    }
+    if (kernel != KERNEL_LUT && this->colour_map) {
+        return false;
+    }
+    if ((kernel == KERNEL_SSSE3 || kernel == KERNEL_AVX2) && !this->byte_aligned) {
+        return false;
+    }
+    this->kernel = kernel;
+    return true;
+}
+
+void pixel_converter::convert_row(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    switch (this->kernel) {
+    case KERNEL_AVX2:
+        this->convert_row_avx2(src, dst, width);
+        break;
+    case KERNEL_SSSE3:
+        this->convert_row_ssse3(src, dst, width);
+        break;
+    case KERNEL_FIXED:
+        this->fixed_row(src, dst, width);
+        break;
+    case KERNEL_LUT:
+        this->convert_row_lut(src, dst, width);
+        break;
+    default:
+        this->convert_row_scalar(src, dst, width);
+        break;
+    }
+}
+
+void pixel_converter::set_colour(uint8_t index, uint16_t red, uint16_t green, uint16_t blue)
+{
+    this->lut[index * 3 + 0] = blue >> 8;
+    this->lut[index * 3 + 1] = green >> 8;
+    this->lut[index * 3 + 2] = red >> 8;
+}
+
+void pixel_converter::convert_row_lut(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    for (size_t x = 0; x < width; x++) {
+        const uint8_t *bgr = &this->lut[(src[x] & 0xff) * 3];
+        dst[x * 3 + 0] = bgr[0];
+        dst[x * 3 + 1] = bgr[1];
+        dst[x * 3 + 2] = bgr[2];
+    }
+}
+
+void pixel_converter::convert_row_scalar(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    // same as convert_row_fixed() but everything at runtime
+    for (size_t x = 0; x < width; x++) {
+        uint32_t value = src[x];
+        if (this->big_endian) {
+            value = (this->bits_per_pixel == 32) ? __builtin_bswap32(value)
+                : (this->bits_per_pixel == 16) ? __builtin_bswap16(value) : value;
+        }
+        uint32_t blue = (value >> this->blue_shift) & this->blue_max;
+        uint32_t green = (value >> this->green_shift) & this->green_max;
+        uint32_t red = (value >> this->red_shift) & this->red_max;
+        dst[x * 3 + 0] = (this->blue_max == 0xff || this->blue_max == 0) ? blue : (blue * 0xff + this->blue_max / 2) / this->blue_max;
+        dst[x * 3 + 1] = (this->green_max == 0xff || this->green_max == 0) ? green : (green * 0xff + this->green_max / 2) / this->green_max;
+        dst[x * 3 + 2] = (this->red_max == 0xff || this->red_max == 0) ? red : (red * 0xff + this->red_max / 2) / this->red_max;
+    }
+}
+
+#ifdef PIXEL_CONVERTER_X86
+
+// SSE2 alone has no byte shuffle, so the narrowest vector kernel is SSSE3 (pshufb).
+__attribute__((target("ssse3")))
+void pixel_converter::convert_row_ssse3(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    // 4 pixels of 4 bytes into 12 bytes of B,G,R
+    int8_t mask[16];
+    for (int i = 0; i < 16; i++) {
+        mask[i] = (i < 12) ? (i / 3) * 4 + this->offsets[i % 3] : -1;
+    }
+    const __m128i shuffle = _mm_loadu_si128((const __m128i*)mask);
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i bgr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + x)), shuffle);
+        // exactly 12 bytes, the next ones may be outside the damaged area
+        _mm_storel_epi64((__m128i*)(dst + x * 3), bgr);
+        uint32_t rest = _mm_cvtsi128_si32(_mm_srli_si128(bgr, 8));
+        memcpy(dst + x * 3 + 8, &rest, sizeof(rest));
+    }
+    this->convert_row_scalar(src + x, dst + x * 3, width - x);
+}
+
+__attribute__((target("avx2")))
+void pixel_converter::convert_row_avx2(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    // shuffle works within each 128bit lane, then the 2 lanes of 12 bytes are packed into 24 bytes
+    int8_t mask[32];
+    for (int i = 0; i < 32; i++) {
+        int j = i % 16;
+        mask[i] = (j < 12) ? (j / 3) * 4 + this->offsets[j % 3] : -1;
+    }
+    const __m256i shuffle = _mm256_loadu_si256((const __m256i*)mask);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i bgr = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + x)), shuffle);
+        bgr = _mm256_permutevar8x32_epi32(bgr, pack);
+        _mm_storeu_si128((__m128i*)(dst + x * 3), _mm256_castsi256_si128(bgr));
+        _mm_storel_epi64((__m128i*)(dst + x * 3 + 16), _mm256_extracti128_si256(bgr, 1));
+    }
+    this->convert_row_ssse3(src + x, dst + x * 3, width - x);
+}
+
+#else
+
+void pixel_converter::convert_row_ssse3(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    this->convert_row_scalar(src, dst, width);
+}
+
+void pixel_converter::convert_row_avx2(const uint32_t *src, uint8_t *dst, size_t width) const
+{
+    this->convert_row_scalar(src, dst, width);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __PIXEL_CONVERTER_H__
+#define __PIXEL_CONVERTER_H__
+
+#include <bits/stdc++.h>
+
+#include "rfb_protocol.h"
+
+// Converts rows of the frame buffer into BGR rows of the output image.
+// The kernel is selected from the pixel format and what the CPU supports:
+// vectorized ones for 32bpp formats whose colours are whole bytes,
+// ones specialized at compile time for common native formats of servers,
+// a lookup table for 8bpp formats including the colour map, and the scalar one for any other true colour format.
+class pixel_converter
+{
+ public:
+    typedef enum kernel {
+        KERNEL_SCALAR,
+        KERNEL_FIXED,
+        KERNEL_LUT,
+        KERNEL_SSSE3,
+        KERNEL_AVX2,
+    } kernel_t;
+    typedef void (*row_func_t)(const uint32_t *src, uint8_t *dst, size_t width);
+ private:
+    uint8_t bits_per_pixel = 32;
+    bool big_endian = false;
+    // pixels are indexes of the colour map, kept in the lookup table
+    bool colour_map = false;
+    uint16_t red_max = 0xff;
+    uint16_t green_max = 0xff;
+    uint16_t blue_max = 0xff;
+    uint8_t red_shift = 16;
+    uint8_t green_shift = 8;
+    uint8_t blue_shift = 0;
+    // byte offset of blue, green and red in a pixel when they are whole bytes
+    bool byte_aligned = true;
+    uint8_t offsets[3] = {0, 1, 2};
+    // specialized for the format, NULL if it is not one of the known formats
+    row_func_t fixed_row = NULL;
+    // BGR of every 8bpp pixel value
+    uint8_t lut[256 * 3] = {};
+    kernel_t kernel = KERNEL_SCALAR;
+
+    void select_fastest_kernel();
+    void build_lut();
+    void convert_row_lut(const uint32_t *src, uint8_t *dst, size_t width) const;
+    void convert_row_scalar(const uint32_t *src, uint8_t *dst, size_t width) const;
+    void convert_row_ssse3(const uint32_t *src, uint8_t *dst, size_t width) const;
+    void convert_row_avx2(const uint32_t *src, uint8_t *dst, size_t width) const;
+ public:
+    pixel_converter();
+    void set_pixel_format(const pixel_format_t &pixel_format);
+    // false if the CPU or the pixel format does not allow the kernel
+    bool select_kernel(kernel_t kernel);
+    void convert_row(const uint32_t *src, uint8_t *dst, size_t width) const;
+    // an entry of SetColourMapEntries, colours are 16bit
+    void set_colour(uint8_t index, uint16_t red, uint16_t green, uint16_t blue);
+
+    kernel_t get_kernel() const { return this->kernel; };
+    static bool is_supported(kernel_t kernel);
+};
+
+#endif
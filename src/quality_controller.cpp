@@ -0,0 +1,61 @@
+#include "quality_controller.h"
+
+#include "jpeg_encoder.h"
+
+const int quality_controller::MIN_QUALITY;
+const int quality_controller::QUALITY_STEP;
+
+// weight of the latest frame in the throughput
+static const double SMOOTHING = 0.25;
+// a frame one level up is up to this times larger
+static const double STEP_UP_HEADROOM = 2.0;
+// frames in a row under the budget with the headroom before stepping up
+static const int STEP_UP_FRAMES = 3;
+
+quality_controller::quality_controller()
+{
+    this->set_max_quality(jpeg_encoder::DEFAULT_QUALITY);
+}
+
+void quality_controller::set_max_quality(int quality)
+{
+    quality = std::max(MIN_QUALITY, std::min(100, quality));
+    this->levels.clear();
+    this->levels.push_back({quality, ycbcr_planes::SUBSAMPLING_444});
+    for (int q = quality; q > MIN_QUALITY; q -= QUALITY_STEP) {
+        this->levels.push_back({q, ycbcr_planes::SUBSAMPLING_420});
+    }
+    this->levels.push_back({MIN_QUALITY, ycbcr_planes::SUBSAMPLING_420});
+    this->level = std::min(this->level, this->levels.size() - 1);
+}
+
+void quality_controller::set_budget(uint32_t milliseconds)
+{
+    this->budget = milliseconds * 1000;
+}
+
+void quality_controller::report(size_t size, uint32_t microseconds)
+{
+    if (this->budget == 0 || size == 0) {
+        return;
+    }
+    double sample = size * 1000000.0 / std::max<uint32_t>(microseconds, 1);
+    this->throughput = (this->throughput == 0) ? sample : this->throughput + (sample - this->throughput) * SMOOTHING;
+    double estimated = size * 1000000.0 / this->throughput;
+    if (estimated > this->budget) {
+        // one level down, and one more for each time the frame is twice over the budget
+        for (double over = estimated; over > this->budget && this->level + 1 < this->levels.size(); over /= 2) {
+            this->level++;
+        }
+        this->frames_under_budget = 0;
+        return;
+    }
+    if (estimated * STEP_UP_HEADROOM > this->budget) {
+        this->frames_under_budget = 0;
+        return;
+    }
+    if (++this->frames_under_budget >= STEP_UP_FRAMES && this->level > 0) {
+        this->level--;
+        this->frames_under_budget = 0;
+    }
+}
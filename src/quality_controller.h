@@ -0,0 +1,45 @@
+#ifndef __QUALITY_CONTROLLER_H__
+#define __QUALITY_CONTROLLER_H__
+
+#include <bits/stdc++.h>
+
+#include "ycbcr_planes.h"
+
+// Chooses the quality and the chroma subsampling of JPEG frame by frame to deliver a frame within a budget.
+// The throughput to the client is estimated from the size of each frame sent and the time it took to deliver it.
+// The settings step down as soon as a frame would take longer than the budget,
+// and step up again only after a few frames in a row would fit even if they were larger,
+// so the compressed bands are not thrown away by settings going back and forth.
+class quality_controller
+{
+ public:
+    typedef struct level {
+        int quality;
+        ycbcr_planes::subsampling_t subsampling;
+    } level_t;
+ private:
+    // from the best, 4:4:4 at the highest quality then 4:2:0 down to MIN_QUALITY
+    std::vector<level_t> levels;
+    size_t level = 0;
+    // microseconds to deliver a frame, 0 for no control
+    uint32_t budget = 0;
+    // bytes per second, 0 until the first frame is delivered
+    double throughput = 0;
+    int frames_under_budget = 0;
+ public:
+    static const int MIN_QUALITY = 30;
+    static const int QUALITY_STEP = 10;
+
+    quality_controller();
+    // the best level, lower levels go down from it
+    void set_max_quality(int quality);
+    void set_budget(uint32_t milliseconds);
+    bool is_enabled() const { return this->budget > 0; };
+    // a frame of size bytes took microseconds to deliver, then the level for the next frame is chosen
+    void report(size_t size, uint32_t microseconds);
+
+    const level_t &get_level() const { return this->levels[this->level]; };
+    double get_throughput() const { return this->throughput; };
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define __RFB_PROTOCOL_H__
 
 const uint16_t RFB_BUF_SIZE = 256;
+const uint16_t RFB_MAX_NUMBER_OF_ENCODINGS = 32;
 
 // RFB 003.003\n
 const uint8_t RFB_PROTOCOL_VERSION_3_3[] = {0x52, 0x46, 0x42, 0x20, 0x30, 0x30, 0x33, 0x2e, 0x30, 0x30, 0x33, 0x0a};
@@ -18,21 +19,73 @@ const uint8_t RFB_SHARED_FLAG_OFF           = 0x00;
 const uint8_t RFB_INCREMENTAL_OFF           = 0x00;
 const uint8_t RFB_INCREMENTAL_ON            = 0x01;
 const uint8_t RFB_ENCODING_RAW              = 0x00;
+const int32_t RFB_ENCODING_COPY_RECT        = 0x01;
+const int32_t RFB_ENCODING_RRE              = 0x02;
+const int32_t RFB_ENCODING_CORRE            = 0x04;
+const int32_t RFB_ENCODING_HEXTILE          = 0x05;
+const int32_t RFB_ENCODING_TIGHT            = 0x07;
+const int32_t RFB_ENCODING_TRLE             = 0x0f;
+const int32_t RFB_ENCODING_ZRLE             = 0x10;
+// pseudo-encodings, level n is LEVEL_0 + n (0-9)
+const int32_t RFB_ENCODING_COMPRESS_LEVEL_0 = -256;
+const int32_t RFB_ENCODING_QUALITY_LEVEL_0  = -32;
+const int32_t RFB_ENCODING_DESKTOP_SIZE     = -223;
+const int32_t RFB_ENCODING_CURSOR           = -239;
+const int32_t RFB_ENCODING_X_CURSOR         = -240;
+const int32_t RFB_ENCODING_EXTENDED_DESKTOP_SIZE = -308;
+const int32_t RFB_ENCODING_FENCE            = -312;
+const int32_t RFB_ENCODING_CONTINUOUS_UPDATES = -313;
+const uint8_t RFB_HEXTILE_TILE_SIZE         = 16;
+const uint8_t RFB_HEXTILE_RAW                        = 0x01;
+const uint8_t RFB_HEXTILE_BACKGROUND_SPECIFIED       = 0x02;
+const uint8_t RFB_HEXTILE_FOREGROUND_SPECIFIED       = 0x04;
+const uint8_t RFB_HEXTILE_ANY_SUBRECTS               = 0x08;
+const uint8_t RFB_HEXTILE_SUBRECTS_COLOURED          = 0x10;
+const uint8_t RFB_ZRLE_TILE_SIZE            = 64;
+const uint8_t RFB_ZRLE_RAW                           = 0;
+const uint8_t RFB_ZRLE_SOLID                         = 1;
+const uint8_t RFB_ZRLE_PACKED_PALETTE_MAX            = 16;
+const uint8_t RFB_ZRLE_PLAIN_RLE                     = 128;
+const uint8_t RFB_ZRLE_PALETTE_RLE_MIN               = 130;
+const uint8_t RFB_TRLE_TILE_SIZE            = 16;
+const uint8_t RFB_TRLE_PACKED_PALETTE_REUSE          = 127;
+const uint8_t RFB_TRLE_PALETTE_RLE_REUSE             = 129;
+const uint8_t RFB_TIGHT_NUMBER_OF_STREAMS    = 4;
+const uint8_t RFB_TIGHT_MIN_TO_COMPRESS      = 12;
+const uint8_t RFB_TIGHT_EXPLICIT_FILTER              = 0x04;
+const uint8_t RFB_TIGHT_STREAM_ID_MASK               = 0x03;
+const uint8_t RFB_TIGHT_MAX_BASIC                    = 0x07;
+const uint8_t RFB_TIGHT_FILL                         = 0x08;
+const uint8_t RFB_TIGHT_JPEG                         = 0x09;
+const uint8_t RFB_TIGHT_FILTER_COPY                  = 0x00;
+const uint8_t RFB_TIGHT_FILTER_PALETTE               = 0x01;
+const uint8_t RFB_TIGHT_FILTER_GRADIENT              = 0x02;
 const uint8_t RFB_KEY_UP                    = 0x00;
 const uint8_t RFB_KEY_DOWN                  = 0x01;
 const uint8_t RFB_POINTER_BUTTON_LEFT       = 0x00;
 const uint8_t RFB_POINTER_BUTTON_RIGHT      = 0x02;
 const uint8_t RFB_POINTER_UP                = 0x00;
 const uint8_t RFB_POINTER_DOWN              = 0x01;
+const uint8_t RFB_CONTINUOUS_UPDATES_OFF    = 0x00;
+const uint8_t RFB_CONTINUOUS_UPDATES_ON     = 0x01;
+const uint32_t RFB_FENCE_BLOCK_BEFORE       = 0x00000001;
+const uint32_t RFB_FENCE_BLOCK_AFTER        = 0x00000002;
+const uint32_t RFB_FENCE_SYNC_NEXT          = 0x00000004;
+const uint32_t RFB_FENCE_REQUEST            = 0x80000000;
+const uint8_t RFB_FENCE_MAX_PAYLOAD_LENGTH  = 64;
 const uint8_t RFB_MESSAGE_TYPE_SET_PIXEL_FORMAT            = 0x00;
 const uint8_t RFB_MESSAGE_TYPE_SET_ENCODINGS               = 0x02;
 const uint8_t RFB_MESSAGE_TYPE_FRAME_BUFFER_UPDATE_REQUEST = 0x03;
 const uint8_t RFB_MESSAGE_TYPE_KEY_EVENT                   = 0x04;
 const uint8_t RFB_MESSAGE_TYPE_POINTER_EVENT               = 0x05;
+const uint8_t RFB_MESSAGE_TYPE_ENABLE_CONTINUOUS_UPDATES   = 0x96;
 const uint8_t RFB_MESSAGE_TYPE_FRAME_BUFFER_UPDATE         = 0x00;
 const uint8_t RFB_MESSAGE_TYPE_SET_COLOUR_MAP_ENTRIES      = 0x01;
 const uint8_t RFB_MESSAGE_TYPE_BELL                        = 0x02;
 const uint8_t RFB_MESSAGE_TYPE_SERVER_CUT_TEXT             = 0x03;
+const uint8_t RFB_MESSAGE_TYPE_END_OF_CONTINUOUS_UPDATES   = 0x96;
+// sent in both directions
+const uint8_t RFB_MESSAGE_TYPE_FENCE                       = 0xf8;
 
 const uint32_t RFB_KEY_CODE_BACKSPACE = 0xff08;
 const uint32_t RFB_KEY_CODE_PERIOD    = 0x002e;
@@ -60,9 +113,66 @@ typedef struct pixel_data {
     uint16_t width;
     uint16_t height;
     int32_t encoding_type;
-    //uint8_t pixels[]; // currently only support raw encoding
+    //uint8_t pixels[]; // depends on encoding_type
 } pixel_data_t;
 
+typedef struct copy_rect {
+    uint16_t src_x_position;
+    uint16_t src_y_position;
+} copy_rect_t;
+
+typedef struct rre {
+    uint32_t number_of_subrectangles;
+    //uint8_t background_pixel_value[];
+} rre_t;
+
+typedef struct rre_subrectangle {
+    //uint8_t pixel_value[];
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+} rre_subrectangle_t;
+
+typedef struct corre_subrectangle {
+    //uint8_t pixel_value[];
+    uint8_t x_position;
+    uint8_t y_position;
+    uint8_t width;
+    uint8_t height;
+} corre_subrectangle_t;
+
+typedef struct zrle {
+    uint32_t length;
+    //uint8_t zlib_data[];
+} zrle_t;
+
+typedef struct x_cursor {
+    uint8_t primary_red;
+    uint8_t primary_green;
+    uint8_t primary_blue;
+    uint8_t secondary_red;
+    uint8_t secondary_green;
+    uint8_t secondary_blue;
+    //uint8_t bitmap[];
+    //uint8_t bitmask[];
+} x_cursor_t;
+
+typedef struct extended_desktop_size {
+    uint8_t number_of_screens;
+    uint8_t padding[3];
+    //screen_t screens[];
+} extended_desktop_size_t;
+
+typedef struct screen {
+    uint32_t id;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+    uint32_t flags;
+} screen_t;
+
 typedef struct colour_data {
     uint16_t red;
     uint16_t green;
@@ -119,7 +229,7 @@ typedef struct set_encodings {
     uint8_t message_type = RFB_MESSAGE_TYPE_SET_ENCODINGS;
     uint8_t padding;
     uint16_t number_of_encodings;
-    int32_t encoding_type; // temporary only 1 slot
+    int32_t encoding_types[RFB_MAX_NUMBER_OF_ENCODINGS]; // only number_of_encodings slots are sent
 } set_encodings_t;
 
 typedef struct frame_buffer_update_request {
@@ -145,6 +255,23 @@ typedef struct pointer_event {
     uint16_t y_position;
 } pointer_event_t;
 
+typedef struct enable_continuous_updates {
+    uint8_t message_type = RFB_MESSAGE_TYPE_ENABLE_CONTINUOUS_UPDATES;
+    uint8_t enable_flag;
+    uint16_t x_position;
+    uint16_t y_position;
+    uint16_t width;
+    uint16_t height;
+} enable_continuous_updates_t;
+
+typedef struct fence {
+    uint8_t message_type = RFB_MESSAGE_TYPE_FENCE;
+    uint8_t padding[3];
+    uint32_t flags;
+    uint8_t length;
+    uint8_t payload[RFB_FENCE_MAX_PAYLOAD_LENGTH]; // only length bytes are sent
+} fence_t;
+
 // server to client messages
 typedef struct frame_buffer_update {
     uint8_t message_type = RFB_MESSAGE_TYPE_FRAME_BUFFER_UPDATE;
@@ -172,4 +299,8 @@ typedef struct server_cut_text {
     //uint8_t text[];
 } server_cut_text_t;
 
+typedef struct end_of_continuous_updates {
+    uint8_t message_type = RFB_MESSAGE_TYPE_END_OF_CONTINUOUS_UPDATES;
+} end_of_continuous_updates_t;
+
 #endif
@@ -0,0 +1,173 @@
+#include <sys/socket.h>
+#include <limits.h>
+#include <poll.h>
+
+#include "socket_reader.h"
+
+const size_t socket_reader::DEFAULT_CAPACITY;
+
+socket_reader::socket_reader(size_t capacity)
+    : ring(capacity)
+{
+}
+
+void socket_reader::set_fd(int fd)
+{
+    this->fd = fd;
+    this->head = 0;
+    this->length = 0;
+}
+
+void socket_reader::set_deadline(int timeout_msec)
+{
+    this->has_deadline = (timeout_msec >= 0);
+    this->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_msec);
+}
+
+bool socket_reader::read_exact(void *buf, size_t size)
+{
+    uint8_t *dst = (uint8_t*)buf;
+    while (size > 0) {
+        if (this->length > 0) {
+            size_t consumed = this->consume(dst, size);
+            dst += consumed;
+            size -= consumed;
+            continue;
+        }
+        if (size < this->ring.size() / 2) {
+            if (!this->fill()) {
+                return false;
+            }
+            continue;
+        }
+        // no point in copying through the ring buffer
+        if (!this->wait_readable_until_deadline()) {
+            return false;
+        }
+        ssize_t recv_length = recv(this->fd, dst, size, 0);
+        if (recv_length <= 0) {
+            return false;
+        }
+        dst += recv_length;
+        size -= recv_length;
+    }
+    return true;
+}
+
+bool socket_reader::read_exactv(struct iovec *iov, int iovcnt)
+{
+    int index = 0;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    // the buffered bytes first, small ones entirely through the ring buffer
+    while (index < iovcnt && (this->length > 0 || total < this->ring.size() / 2)) {
+        if (iov[index].iov_len == 0) {
+            index++;
+            continue;
+        }
+        size_t consumed = this->length > 0 ? this->consume((uint8_t*)iov[index].iov_base, iov[index].iov_len) : 0;
+        if (consumed == 0 && !this->fill()) {
+            return false;
+        }
+        total -= consumed;
+        iov[index].iov_base = (uint8_t*)iov[index].iov_base + consumed;
+        iov[index].iov_len -= consumed;
+        if (iov[index].iov_len == 0) {
+            index++;
+        }
+    }
+    while (index < iovcnt) {
+        if (!this->wait_readable_until_deadline()) {
+            return false;
+        }
+        ssize_t recv_length = readv(this->fd, &iov[index], std::min(iovcnt - index, IOV_MAX));
+        if (recv_length <= 0) {
+            return false;
+        }
+        // skip the filled buffers and advance the partially filled one
+        while (recv_length > 0) {
+            if ((size_t)recv_length >= iov[index].iov_len) {
+                recv_length -= iov[index].iov_len;
+                index++;
+            } else {
+                iov[index].iov_base = (uint8_t*)iov[index].iov_base + recv_length;
+                iov[index].iov_len -= recv_length;
+                recv_length = 0;
+            }
+        }
+    }
+    return true;
+}
+
+bool socket_reader::wait_readable(int timeout_msec)
+{
+    if (this->length > 0) {
+        return true;
+    }
+    struct pollfd pfd = {};
+    pfd.fd = this->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout_msec) > 0;
+}
+
+bool socket_reader::wait_readable_until_deadline()
+{
+    int timeout_msec = -1;
+    if (this->has_deadline) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(this->deadline - std::chrono::steady_clock::now());
+        timeout_msec = std::max<int>(remaining.count(), 0);
+    }
+    struct pollfd pfd = {};
+    pfd.fd = this->fd;
+    pfd.events = POLLIN;
+    int res = poll(&pfd, 1, timeout_msec);
+    if (res == 0) {
+        errno = ETIMEDOUT;
+    }
+    return res > 0;
+}
+
+bool socket_reader::fill()
+{
+    if (this->length == 0) {
+        this->head = 0;
+    }
+    size_t capacity = this->ring.size();
+    size_t tail = (this->head + this->length) % capacity;
+    // free space may wrap around the end of the ring
+    struct iovec iov[2] = {};
+    int iovcnt = 1;
+    iov[0].iov_base = &this->ring[tail];
+    if (tail >= this->head) {
+        iov[0].iov_len = capacity - tail;
+        iov[1].iov_base = &this->ring[0];
+        iov[1].iov_len = this->head;
+        iovcnt = (this->head > 0) ? 2 : 1;
+    } else {
+        iov[0].iov_len = this->head - tail;
+    }
+    if (!this->wait_readable_until_deadline()) {
+        return false;
+    }
+    ssize_t recv_length = readv(this->fd, iov, iovcnt);
+    if (recv_length <= 0) {
+        return false;
+    }
+    this->length += recv_length;
+    return true;
+}
+
+size_t socket_reader::consume(uint8_t *buf, size_t size)
+{
+    size_t capacity = this->ring.size();
+    size_t consumed = std::min(size, this->length);
+    // at most 2 pieces, up to the end of the ring and from the beginning
+    size_t first = std::min(consumed, capacity - this->head);
+    memcpy(buf, &this->ring[this->head], first);
+    memcpy(buf + first, &this->ring[0], consumed - first);
+    this->head = (this->head + consumed) % capacity;
+    this->length -= consumed;
+    return consumed;
+}
@@ -0,0 +1,39 @@
+#ifndef __SOCKET_READER_H__
+#define __SOCKET_READER_H__
+
+#include <bits/stdc++.h>
+#include <sys/uio.h>
+
+// Buffered reader of a socket.
+// Small reads are served from a ring buffer filled by as large recv as possible,
+// large reads go straight to the destination after the buffered bytes.
+// Every read waits only until the deadline of the current operation.
+class socket_reader
+{
+ private:
+    int fd = -1;
+    std::vector<uint8_t> ring;
+    // position of the first buffered byte and the number of buffered bytes
+    size_t head = 0;
+    size_t length = 0;
+    bool has_deadline = false;
+    std::chrono::steady_clock::time_point deadline;
+
+    bool wait_readable_until_deadline();
+    bool fill();
+    size_t consume(uint8_t *buf, size_t size);
+ public:
+    static const size_t DEFAULT_CAPACITY = 256 * 1024;
+
+    socket_reader(size_t capacity = DEFAULT_CAPACITY);
+    void set_fd(int fd);
+    // timeout of the operation from now, negative for no deadline
+    void set_deadline(int timeout_msec);
+    bool read_exact(void *buf, size_t size);
+    bool read_exactv(struct iovec *iov, int iovcnt);
+    bool wait_readable(int timeout_msec);
+
+    size_t get_buffered() const { return this->length; };
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(size_t threads)
+{
+    for (size_t i = 1; i < threads; i++) {
+        this->threads.push_back(std::thread(&thread_pool::work, this));
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->task_ready.notify_all();
+    for (size_t i = 0; i < this->threads.size(); i++) {
+        this->threads[i].join();
+    }
+}
+
+void thread_pool::run(size_t count, const std::function<void(size_t)> &task)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->task = &task;
+    this->next = 0;
+    this->count = count;
+    this->done = 0;
+    this->task_ready.notify_all();
+    while (this->run_next(lock)) {
+    }
+    this->task_done.wait(lock, [this] { return this->done == this->count; });
+    this->task = NULL;
+}
+
+void thread_pool::work()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->task_ready.wait(lock, [this] { return this->stopping || this->next < this->count; });
+        if (this->stopping) {
+            return;
+        }
+        this->run_next(lock);
+    }
+}
+
+bool thread_pool::run_next(std::unique_lock<std::mutex> &lock)
+{
+    // called with the lock held, which is released while the task runs
+    if (this->next >= this->count) {
+        return false;
+    }
+    size_t index = this->next++;
+    const std::function<void(size_t)> *task = this->task;
+    lock.unlock();
+    (*task)(index);
+    lock.lock();
+    if (++this->done == this->count) {
+        this->task_done.notify_all();
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <bits/stdc++.h>
+
+// Fixed number of worker threads running the indexes of one task at a time.
+// The caller of run() works on the indexes too and returns when all of them are done.
+class thread_pool
+{
+ private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable task_done;
+    const std::function<void(size_t)> *task = NULL;
+    // next index to take, number of indexes and finished ones
+    size_t next = 0;
+    size_t count = 0;
+    size_t done = 0;
+    bool stopping = false;
+
+    void work();
+    bool run_next(std::unique_lock<std::mutex> &lock);
+ public:
+    // threads - 1 workers are started, the caller is the last one
+    thread_pool(size_t threads);
+    ~thread_pool();
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+    void run(size_t count, const std::function<void(size_t)> &task);
+
+    size_t get_size() const { return this->threads.size() + 1; };
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include "opencv2/opencv.hpp"
@@ -14,6 +15,89 @@ const std::string vnc_client::KEY_PERIOD    = ".";
 const std::string vnc_client::KEY_ENTER     = "Enter";
 const std::string vnc_client::KEY_SPACE     = "Space";
 const std::string vnc_client::KEY_SLASH     = "/";
+const int vnc_client::DEFAULT_WEBP_QUALITY;
+const int vnc_client::DEFAULT_PNG_COMPRESSION;
+
+// in order of preference
+const std::vector<int32_t> vnc_client::DEFAULT_ENCODING_TYPES = {
+    RFB_ENCODING_COPY_RECT,
+    RFB_ENCODING_TIGHT,
+    RFB_ENCODING_ZRLE,
+    RFB_ENCODING_TRLE,
+    RFB_ENCODING_HEXTILE,
+    RFB_ENCODING_CORRE,
+    RFB_ENCODING_RRE,
+    RFB_ENCODING_RAW,
+    RFB_ENCODING_COMPRESS_LEVEL_0 + 6,
+    RFB_ENCODING_QUALITY_LEVEL_0 + 6,
+    RFB_ENCODING_EXTENDED_DESKTOP_SIZE,
+    RFB_ENCODING_DESKTOP_SIZE,
+    RFB_ENCODING_CURSOR,
+    RFB_ENCODING_X_CURSOR,
+    RFB_ENCODING_CONTINUOUS_UPDATES,
+    RFB_ENCODING_FENCE,
+};
+
+const std::vector<vnc_client::decoder_t> vnc_client::DECODERS = {
+    {RFB_ENCODING_RAW, "raw", &vnc_client::recv_raw_rectangle},
+    {RFB_ENCODING_COPY_RECT, "copyrect", &vnc_client::recv_copy_rect_rectangle},
+#if MRHC_DECODER_RRE
+    {RFB_ENCODING_RRE, "rre", &vnc_client::recv_rre_rectangle},
+    {RFB_ENCODING_CORRE, "corre", &vnc_client::recv_corre_rectangle},
+#endif
+#if MRHC_DECODER_HEXTILE
+    {RFB_ENCODING_HEXTILE, "hextile", &vnc_client::recv_hextile_rectangle},
+#endif
+#if MRHC_DECODER_TRLE
+    {RFB_ENCODING_TRLE, "trle", &vnc_client::recv_trle_rectangle},
+#endif
+#if MRHC_DECODER_ZRLE
+    {RFB_ENCODING_ZRLE, "zrle", &vnc_client::recv_zrle_rectangle},
+#endif
+#if MRHC_DECODER_TIGHT
+    {RFB_ENCODING_TIGHT, "tight", &vnc_client::recv_tight_rectangle},
+#endif
+};
+
+// handled by recv_rectangle() or the client itself, not by a decoder
+static const std::vector<std::pair<std::string, int32_t>> PSEUDO_ENCODING_TYPES = {
+    {"desktopsize", RFB_ENCODING_DESKTOP_SIZE},
+    {"extendeddesktopsize", RFB_ENCODING_EXTENDED_DESKTOP_SIZE},
+    {"cursor", RFB_ENCODING_CURSOR},
+    {"xcursor", RFB_ENCODING_X_CURSOR},
+    {"continuousupdates", RFB_ENCODING_CONTINUOUS_UPDATES},
+    {"fence", RFB_ENCODING_FENCE},
+};
+// "quality=n" and "compress=n"
+static const std::string QUALITY_LEVEL_PREFIX = "quality=";
+static const std::string COMPRESS_LEVEL_PREFIX = "compress=";
+static const int32_t MAX_LEVEL = 9;
+// names of image formats
+static const std::vector<std::pair<std::string, image_format_t>> IMAGE_FORMATS = {
+    {"jpeg", IMAGE_FORMAT_JPEG},
+    {"webp", IMAGE_FORMAT_WEBP},
+    {"webp-lossless", IMAGE_FORMAT_WEBP_LOSSLESS},
+    {"png", IMAGE_FORMAT_PNG},
+};
+// quality of WebP which makes OpenCV encode it losslessly
+static const int WEBP_LOSSLESS_QUALITY = 101;
+
+// servers answer an incremental request only when something has changed,
+// so the current frame buffer is used if no update comes in this time.
+static const int INCREMENTAL_UPDATE_TIMEOUT_MSEC = 100;
+// with continuous updates, the ones which have already arrived are taken up to this time
+static const int PUSHED_UPDATES_TIMEOUT_MSEC = 100;
+// continuous updates paused for a slow viewer are resumed after this many fences in a row are answered in time
+static const int RESUME_FENCES = 3;
+// deadlines of whole operations, a server stalling in the middle of a message fails them
+static const int HANDSHAKE_TIMEOUT_MSEC = 10 * 1000;
+static const int UPDATE_TIMEOUT_MSEC = 30 * 1000;
+// raw pixels smaller than 32bpp are received in chunks of about this size
+static const uint32_t RAW_RECV_SIZE = 64 * 1024;
+// sizes of a frame buffer the server resizes to beyond this are not allocated
+static const uint16_t MAX_FRAME_BUFFER_SIZE = 16384;
+// cursor shapes larger than this are refused before allocating for them
+static const uint16_t MAX_CURSOR_SIZE = 256;
 
 // Since connect() can wait too long, add timeout to connect()
 // This is effective when the input connection destination is wrong.
@@ -70,14 +154,80 @@ static int connect_with_timeout(int sockfd, struct sockaddr *addr, size_t addrle
 
 //// public /////
 
+bool vnc_client::parse_encoding_type(const std::string name, int32_t *encoding_type)
+{
+    for (const decoder_t &decoder : DECODERS) {
+        if (name == decoder.name) {
+            *encoding_type = decoder.encoding_type;
+            return true;
+        }
+    }
+    for (const auto &pseudo : PSEUDO_ENCODING_TYPES) {
+        if (name == pseudo.first) {
+            *encoding_type = pseudo.second;
+            return true;
+        }
+    }
+    const std::string prefixes[] = {QUALITY_LEVEL_PREFIX, COMPRESS_LEVEL_PREFIX};
+    const int32_t levels[] = {RFB_ENCODING_QUALITY_LEVEL_0, RFB_ENCODING_COMPRESS_LEVEL_0};
+    for (int i = 0; i < 2; i++) {
+        if (name.compare(0, prefixes[i].size(), prefixes[i]) != 0) {
+            continue;
+        }
+        std::string level = name.substr(prefixes[i].size());
+        if (level.size() != 1 || level[0] < '0' || level[0] - '0' > MAX_LEVEL) {
+            return false;
+        }
+        *encoding_type = levels[i] + (level[0] - '0');
+        return true;
+    }
+    return false;
+}
+
+bool vnc_client::is_encoding_type_supported(int32_t encoding_type)
+{
+    if (find_decoder(encoding_type) != NULL) {
+        return true;
+    }
+    for (const auto &pseudo : PSEUDO_ENCODING_TYPES) {
+        if (encoding_type == pseudo.second) {
+            return true;
+        }
+    }
+    return (encoding_type >= RFB_ENCODING_QUALITY_LEVEL_0 && encoding_type <= RFB_ENCODING_QUALITY_LEVEL_0 + MAX_LEVEL) ||
+        (encoding_type >= RFB_ENCODING_COMPRESS_LEVEL_0 && encoding_type <= RFB_ENCODING_COMPRESS_LEVEL_0 + MAX_LEVEL);
+}
+
+bool vnc_client::parse_image_format(const std::string name, image_format_t *image_format)
+{
+    for (const auto &format : IMAGE_FORMATS) {
+        if (name == format.first) {
+            *image_format = format.second;
+            return true;
+        }
+    }
+    return false;
+}
+
 vnc_client::vnc_client(std::string host, int port, std::string password)
-    : sockfd(0), host(host), port(port), password(password), version(""),  width(0), height(0), pixel_format({}), name("")
+    : sockfd(0), host(host), port(port), password(password), version(""),  width(0), height(0), pixel_format({}), name(""),
+      encoding_types(DEFAULT_ENCODING_TYPES)
 {
     memset(this->challenge, 0, sizeof(this->challenge));
+    memset(&this->zrle_stream, 0, sizeof(this->zrle_stream));
+    memset(this->tight_streams, 0, sizeof(this->tight_streams));
 }
 
 vnc_client::~vnc_client()
 {
+    if (this->zrle_stream_initialized) {
+        inflateEnd(&this->zrle_stream);
+    }
+    for (int i = 0; i < RFB_TIGHT_NUMBER_OF_STREAMS; i++) {
+        if (this->tight_streams_initialized[i]) {
+            inflateEnd(&this->tight_streams[i]);
+        }
+    }
     close(this->sockfd);
 }
 
@@ -102,6 +252,7 @@ bool vnc_client::connect_to_server()
     if (connect_with_timeout(this->sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in), &timeout) < 0) {
         return false;
     }
+    this->reader.set_fd(this->sockfd);
     return true;
 }
 
@@ -110,14 +261,13 @@ bool vnc_client::recv_protocol_version()
     protocol_version_t protocol_version = {};
 
     char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(protocol_version), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(buf, sizeof(protocol_version))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(protocol_version));
     LOGGER_DEBUG(buf);
 
-    memmove(&protocol_version, buf, recv_length);
+    memmove(&protocol_version, buf, sizeof(protocol_version));
 
     if (memcmp(protocol_version.values, RFB_PROTOCOL_VERSION_3_3, sizeof(RFB_PROTOCOL_VERSION_3_3)) == 0) {
         this->version = std::string(buf);
@@ -153,17 +303,25 @@ bool vnc_client::recv_supported_security_types()
 {
     supported_security_types_t supported_security_types = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(supported_security_types), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&supported_security_types.number_of_security_types, sizeof(supported_security_types.number_of_security_types))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&supported_security_types, buf, recv_length);
-
     uint8_t num = supported_security_types.number_of_security_types;
+    if (num == 0) {
+        // the reason string follows instead
+        uint32_t reason_length = 0;
+        if (!this->recv_exact(&reason_length, sizeof(reason_length)) || !this->recv_text(ntohl(reason_length))) {
+            return false;
+        }
+        LOGGER_DEBUG("Connection failed");
+        return false;
+    }
+    if (!this->recv_exact(supported_security_types.security_types, num)) {
+        return false;
+    }
+    LOGGER_DEBUG("recv:%d", num + 1);
+    LOGGER_XDEBUG(((char*)&supported_security_types), num + 1);
+
     for (int i = 0; i < num; i++) {
         this->security_types.push_back(supported_security_types.security_types[i]);
     }
@@ -188,16 +346,13 @@ bool vnc_client::recv_vnc_auth_challenge()
 {
     vnc_auth_challenge_t vnc_auth_challenge = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(vnc_auth_challenge), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&vnc_auth_challenge, sizeof(vnc_auth_challenge))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(vnc_auth_challenge));
+    LOGGER_XDEBUG(((char*)&vnc_auth_challenge), sizeof(vnc_auth_challenge));
 
-    memmove(&vnc_auth_challenge, buf, recv_length);
-    memmove(this->challenge, &vnc_auth_challenge, recv_length);
+    memmove(this->challenge, &vnc_auth_challenge, sizeof(vnc_auth_challenge));
     return true;
 }
 
@@ -221,15 +376,11 @@ bool vnc_client::recv_security_result()
 {
     security_result_t security_result = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(security_result), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&security_result, sizeof(security_result))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&security_result, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(security_result));
+    LOGGER_XDEBUG(((char*)&security_result), sizeof(security_result));
 
     uint32_t status = ntohl(security_result.status);
     LOGGER_DEBUG("status:%lu", status);
@@ -259,45 +410,101 @@ bool vnc_client::recv_server_init()
 {
     server_init_t server_init = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(server_init), 0);
-    if (recv_length < 0) {
+    // fixed part first, the name follows with its length
+    size_t header_length = sizeof(server_init) - sizeof(server_init.name_string);
+    if (!this->recv_exact(&server_init, header_length)) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&server_init, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", header_length);
+    LOGGER_XDEBUG(((char*)&server_init), header_length);
 
     this->width = ntohs(server_init.frame_buffer_width);
     this->height = ntohs(server_init.frame_buffer_height);
-    char name[BUF_SIZE] = {};
-    memmove(name, server_init.name_string, ntohl(server_init.name_length));
-    this->name = std::string(name);
+    this->server_pixel_format = server_init.pixel_format;
+    std::vector<char> name(ntohl(server_init.name_length));
+    if (!this->recv_exact(name.data(), name.size())) {
+        return false;
+    }
+    this->name = std::string(name.begin(), name.end());
 
     LOGGER_DEBUG("frame_buffer_width:%d", this->width);
     LOGGER_DEBUG("frame_buffer_height:%d", this->height);
     LOGGER_DEBUG("name:%s", this->name.c_str());
+    LOGGER_DEBUG("bits_per_pixel:%d", this->server_pixel_format.bits_per_pixel);
+    LOGGER_DEBUG("big_endian_flag:%d", this->server_pixel_format.big_endian_flag);
+    LOGGER_DEBUG("true_colour_flag:%d", this->server_pixel_format.true_colour_flag);
+
+    // framebuffer is kept through the session so that rectangles can be applied in place
+    this->image_buf.resize(this->width, this->height);
+    this->damage.resize(this->width, this->height);
 
     return true;
 }
 
+bool vnc_client::is_native_pixel_format_usable() const
+{
+    const pixel_format_t &pixel_format = this->server_pixel_format;
+    if (!pixel_format.true_colour_flag) {
+        // indexes beyond 8bpp would need a palette larger than pixel_converter keeps
+        return pixel_format.bits_per_pixel == 8;
+    }
+    if (pixel_format.bits_per_pixel != 8 && pixel_format.bits_per_pixel != 16 && pixel_format.bits_per_pixel != 32) {
+        return false;
+    }
+    return ntohs(pixel_format.red_max) > 0 && ntohs(pixel_format.green_max) > 0 && ntohs(pixel_format.blue_max) > 0;
+}
+
 bool vnc_client::send_set_pixel_format()
 {
     set_pixel_format_t set_pixel_format = {};
     pixel_format_t pixel_format = {};
-    pixel_format.bits_per_pixel = 0x20;
-    pixel_format.depth = 0x20;
     pixel_format.big_endian_flag = 0x00;
     pixel_format.true_colour_flag = 0x01;
-    pixel_format.red_max = htons(0xff);
-    pixel_format.green_max = htons(0xff);
-    pixel_format.blue_max = htons(0xff);
-    pixel_format.red_shift = 0x10;
-    pixel_format.green_shift = 0x08;
-    pixel_format.blue_shift = 0x00;
+    if (this->colour_map) {
+        // maxes and shifts have no meaning, the server sends the colour map instead
+        pixel_format.bits_per_pixel = 0x08;
+        pixel_format.depth = 0x08;
+        pixel_format.true_colour_flag = 0x00;
+    } else {
+        switch (this->capture_depth) {
+        case 16:
+            // RGB565
+            pixel_format.bits_per_pixel = 0x10;
+            pixel_format.depth = 0x10;
+            pixel_format.red_max = htons(0x1f);
+            pixel_format.green_max = htons(0x3f);
+            pixel_format.blue_max = htons(0x1f);
+            pixel_format.red_shift = 0x0b;
+            pixel_format.green_shift = 0x05;
+            pixel_format.blue_shift = 0x00;
+            break;
+        case 8:
+            // BGR233
+            pixel_format.bits_per_pixel = 0x08;
+            pixel_format.depth = 0x08;
+            pixel_format.red_max = htons(0x07);
+            pixel_format.green_max = htons(0x07);
+            pixel_format.blue_max = htons(0x03);
+            pixel_format.red_shift = 0x00;
+            pixel_format.green_shift = 0x03;
+            pixel_format.blue_shift = 0x06;
+            break;
+        default:
+            pixel_format.bits_per_pixel = 0x20;
+            pixel_format.depth = 0x18;
+            pixel_format.red_max = htons(0xff);
+            pixel_format.green_max = htons(0xff);
+            pixel_format.blue_max = htons(0xff);
+            pixel_format.red_shift = 0x10;
+            pixel_format.green_shift = 0x08;
+            pixel_format.blue_shift = 0x00;
+            break;
+        }
+    }
+    LOGGER_DEBUG("capture_depth:%d", pixel_format.bits_per_pixel);
     set_pixel_format.pixel_format = pixel_format;
     this->pixel_format = pixel_format;
+    this->converter.set_pixel_format(pixel_format);
 
     int send_length = send(this->sockfd, &set_pixel_format, sizeof(set_pixel_format), 0);
     if (send_length < 0) {
@@ -310,11 +517,26 @@ bool vnc_client::send_set_pixel_format()
 
 bool vnc_client::send_set_encodings()
 {
+    // the server must not send what can not be decoded
+    std::vector<int32_t> encoding_types;
+    for (int32_t encoding_type : this->encoding_types) {
+        if (!is_encoding_type_supported(encoding_type)) {
+            LOGGER_DEBUG("unsupported encoding_type:%d", encoding_type);
+            continue;
+        }
+        encoding_types.push_back(encoding_type);
+    }
+    uint16_t number_of_encodings = std::min<size_t>(encoding_types.size(), RFB_MAX_NUMBER_OF_ENCODINGS);
+
     set_encodings_t set_encodings = {};
-    set_encodings.number_of_encodings = htons(1);
-    set_encodings.encoding_type = htonl(RFB_ENCODING_RAW);
+    set_encodings.number_of_encodings = htons(number_of_encodings);
+    for (int i = 0; i < number_of_encodings; i++) {
+        set_encodings.encoding_types[i] = htonl(encoding_types[i]);
+    }
+    // only send the used slots
+    size_t length = sizeof(set_encodings) - sizeof(set_encodings.encoding_types) + number_of_encodings * sizeof(int32_t);
 
-    int send_length = send(this->sockfd, &set_encodings, sizeof(set_encodings), 0);
+    int send_length = send(this->sockfd, &set_encodings, length, 0);
     if (send_length < 0) {
         return false;
     }
@@ -326,7 +548,8 @@ bool vnc_client::send_set_encodings()
 bool vnc_client::send_frame_buffer_update_request()
 {
     frame_buffer_update_request_t frame_buffer_update_request = {};
-    frame_buffer_update_request.incremental = RFB_INCREMENTAL_OFF;
+    // once the whole frame buffer is received, only the changes are needed
+    frame_buffer_update_request.incremental = this->frame_buffer_received ? RFB_INCREMENTAL_ON : RFB_INCREMENTAL_OFF;
     frame_buffer_update_request.x_position = htons(0);
     frame_buffer_update_request.y_position = htons(0);
     frame_buffer_update_request.width = htons(this->width);
@@ -338,6 +561,7 @@ bool vnc_client::send_frame_buffer_update_request()
     }
     LOGGER_DEBUG("send:%d", send_length);
     LOGGER_XDEBUG(((char*)&frame_buffer_update_request), send_length);
+    this->update_requested = true;
     return true;
 }
 
@@ -347,24 +571,27 @@ bool vnc_client::recv_frame_buffer_update()
 
     frame_buffer_update_t frame_buffer_update = {};
 
-    char buf[BUF_SIZE] = {};
     // size - 1 because message type has already recv
-    int recv_length = recv(this->sockfd, buf, sizeof(frame_buffer_update) - 1, 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&frame_buffer_update.padding, sizeof(frame_buffer_update) - 1)) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&frame_buffer_update.padding, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(frame_buffer_update) - 1);
+    LOGGER_XDEBUG(((char*)&frame_buffer_update.padding), sizeof(frame_buffer_update) - 1);
 
     uint16_t number_of_rectangles = ntohs(frame_buffer_update.number_of_rectangles);
     LOGGER_DEBUG("number_of_rectangles:%d", number_of_rectangles);
 
+    uint16_t width = this->width;
+    uint16_t height = this->height;
     if (!this->recv_rectangles(number_of_rectangles)) {
         LOGGER_DEBUG("failed to recv_rectangles");
         return false;
     }
+    this->update_requested = false;
+    // after resizing, the frame buffer has to be received as a whole again
+    this->frame_buffer_received = (width == this->width && height == this->height);
+    uint32_t sequence = this->damage.commit();
+    LOGGER_DEBUG("frame sequence:%d", sequence);
     return true;
 }
 
@@ -374,25 +601,27 @@ bool vnc_client::recv_set_colour_map_entries()
 
     set_colour_map_entries_t set_colour_map_entries = {};
 
-    char buf[BUF_SIZE] = {};
     // size - 1 because message type has already recv
-    int recv_length = recv(this->sockfd, buf, sizeof(set_colour_map_entries) - 1, 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&set_colour_map_entries.padding, sizeof(set_colour_map_entries) - 1)) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&set_colour_map_entries.padding, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(set_colour_map_entries) - 1);
+    LOGGER_XDEBUG(((char*)&set_colour_map_entries.padding), sizeof(set_colour_map_entries) - 1);
 
+    uint16_t first_colour = ntohs(set_colour_map_entries.first_colour);
     uint16_t number_of_colours = ntohs(set_colour_map_entries.number_of_colours);
+    LOGGER_DEBUG("first_colour:%d", first_colour);
     LOGGER_DEBUG("number_of_colours:%d", number_of_colours);
 
-    if (!this->recv_colours(number_of_colours)) {
+    if (!this->recv_colours(first_colour, number_of_colours)) {
         LOGGER_DEBUG("failed to recv_colours");
         return false;
     }
-    LOGGER_DEBUG("discarded");
+    if (!this->pixel_format.true_colour_flag) {
+        // every pixel may have changed its colour
+        this->damage.add_all();
+        this->damage.commit();
+    }
     return true;
 }
 
@@ -409,16 +638,12 @@ bool vnc_client::recv_server_cut_text()
 
     server_cut_text_t server_cut_text = {};
 
-    char buf[BUF_SIZE] = {};
     // size - 1 because message type has already recv
-    int recv_length = recv(this->sockfd, buf, sizeof(server_cut_text) - 1, 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&server_cut_text.padding, sizeof(server_cut_text) - 1)) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    memmove(&server_cut_text.padding, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(server_cut_text) - 1);
+    LOGGER_XDEBUG(((char*)&server_cut_text.padding), sizeof(server_cut_text) - 1);
 
     uint32_t length = ntohl(server_cut_text.length);
     LOGGER_DEBUG("length:%d", length);
@@ -431,6 +656,127 @@ bool vnc_client::recv_server_cut_text()
     return true;
 }
 
+bool vnc_client::send_enable_continuous_updates(bool enable)
+{
+    enable_continuous_updates_t enable_continuous_updates = {};
+    enable_continuous_updates.enable_flag = enable ? RFB_CONTINUOUS_UPDATES_ON : RFB_CONTINUOUS_UPDATES_OFF;
+    enable_continuous_updates.x_position = htons(0);
+    enable_continuous_updates.y_position = htons(0);
+    enable_continuous_updates.width = htons(this->width);
+    enable_continuous_updates.height = htons(this->height);
+
+    int send_length = send(this->sockfd, &enable_continuous_updates, sizeof(enable_continuous_updates), 0);
+    if (send_length < 0) {
+        return false;
+    }
+    LOGGER_DEBUG("send:%d", send_length);
+    LOGGER_XDEBUG(((char*)&enable_continuous_updates), send_length);
+    // the updates pushed until the server confirms with EndOfContinuousUpdates are still coming
+    if (enable) {
+        this->continuous_updates = true;
+    }
+    return true;
+}
+
+bool vnc_client::pause_continuous_updates()
+{
+    if (!this->send_enable_continuous_updates(false)) {
+        return false;
+    }
+    this->continuous_updates_paused = true;
+    this->fences_in_time = 0;
+    // everything pushed before the confirmation belongs to the frame buffer
+    while (this->continuous_updates) {
+        if (!this->recv_server_to_client_message()) {
+            LOGGER_DEBUG("Failed to recv_server_to_client_message");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool vnc_client::send_fence_request()
+{
+    // the server answers after the updates it has sent before, in the order of the stream
+    this->fence_sequence++;
+    uint32_t payload = htonl(this->fence_sequence);
+    if (!this->send_fence(RFB_FENCE_BLOCK_BEFORE | RFB_FENCE_REQUEST, (const uint8_t *)&payload, sizeof(payload))) {
+        return false;
+    }
+    this->fence_pending = true;
+    return true;
+}
+
+bool vnc_client::recv_end_of_continuous_updates()
+{
+    LOGGER_DEBUG("recv end_of_continuous_updates");
+
+    // the first one tells the server supports continuous updates,
+    // later ones that it has stopped them and requests are needed again
+    this->continuous_updates_supported = true;
+    this->continuous_updates = false;
+    return true;
+}
+
+bool vnc_client::send_fence(uint32_t flags, const uint8_t *payload, uint8_t length)
+{
+    fence_t fence = {};
+    fence.flags = htonl(flags);
+    fence.length = length;
+    memmove(fence.payload, payload, length);
+
+    // only length bytes of the payload are sent
+    size_t size = offsetof(fence_t, payload) + length;
+    int send_length = send(this->sockfd, &fence, size, 0);
+    if (send_length < 0) {
+        return false;
+    }
+    LOGGER_DEBUG("send:%d", send_length);
+    LOGGER_XDEBUG(((char*)&fence), send_length);
+    return true;
+}
+
+bool vnc_client::recv_fence()
+{
+    LOGGER_DEBUG("recv fence");
+
+    fence_t fence = {};
+
+    // up to length because message type has already recv
+    size_t size = offsetof(fence_t, payload) - 1;
+    if (!this->recv_exact(&fence.padding, size)) {
+        return false;
+    }
+    LOGGER_DEBUG("recv:%d", size);
+    LOGGER_XDEBUG(((char*)&fence.padding), size);
+
+    uint32_t flags = ntohl(fence.flags);
+    LOGGER_DEBUG("flags:%08x length:%d", flags, fence.length);
+    if (fence.length > RFB_FENCE_MAX_PAYLOAD_LENGTH) {
+        LOGGER_DEBUG("too long fence payload");
+        return false;
+    }
+    if (!this->recv_exact(fence.payload, fence.length)) {
+        return false;
+    }
+    // servers send a fence first to tell they support it
+    this->fence_supported = true;
+    if (!(flags & RFB_FENCE_REQUEST)) {
+        // the answer to the fence after the last frame
+        uint32_t payload = htonl(this->fence_sequence);
+        if (fence.length == sizeof(payload) && memcmp(fence.payload, &payload, sizeof(payload)) == 0) {
+            this->fence_pending = false;
+        }
+        return true;
+    }
+    // servers measure how fast updates are consumed by the responses and
+    // pace continuous updates with them, so the response is sent right away.
+    // messages are handled in order, which is all BlockBefore and BlockAfter ask for.
+    // SyncNext is not supported and cleared in the response.
+    flags &= (RFB_FENCE_BLOCK_BEFORE | RFB_FENCE_BLOCK_AFTER);
+    return this->send_fence(flags, fence.payload, fence.length);
+}
+
 bool vnc_client::send_key_event(std::string key)
 {
     key_event_t key_event = {};
@@ -504,6 +850,7 @@ bool vnc_client::initialize()
 
 bool vnc_client::authenticate()
 {
+    this->reader.set_deadline(HANDSHAKE_TIMEOUT_MSEC);
     // protocol version
     if (!this->recv_protocol_version()) {
         LOGGER_DEBUG("Failed to recv_protocol_version");
@@ -554,7 +901,12 @@ bool vnc_client::authenticate()
 bool vnc_client::configure()
 {
     // format/encode
-    if (!this->send_set_pixel_format()) {
+    if (this->native_pixel_format && this->is_native_pixel_format_usable()) {
+        // no conversion on the server, pixel_converter handles the format
+        LOGGER_DEBUG("Use the native pixel format");
+        this->pixel_format = this->server_pixel_format;
+        this->converter.set_pixel_format(this->pixel_format);
+    } else if (!this->send_set_pixel_format()) {
         LOGGER_DEBUG("Failed to send_set_pixel_format");
         return false;
     }
@@ -586,6 +938,8 @@ bool vnc_client::operate(vnc_operation_t operation)
         LOGGER_DEBUG("Failed to send_pointer_event");
         return false;
     }
+    this->pointer_x = x;
+    this->pointer_y = y;
     return true;
 }
 
@@ -594,55 +948,149 @@ bool vnc_client::capture(vnc_operation_t operation)
     std::string key = operation.key;
     if (!key.empty()) return true;
 
-    this->clear_buf();
-
-    if (!this->send_frame_buffer_update_request()) {
-        LOGGER_DEBUG("Failed to send_frame_buffer_update_request");
-        return false;
+    // a stalled server fails the capture instead of blocking the request forever
+    this->reader.set_deadline(UPDATE_TIMEOUT_MSEC);
+    if (this->continuous_updates) {
+        if (!this->recv_pushed_updates()) {
+            LOGGER_DEBUG("Failed to recv_pushed_updates");
+            return false;
+        }
+        // the fence after the last frame is not answered yet, so the server pushes more than the viewer takes.
+        // the frames are requested one by one until the link catches up
+        if (this->fence_pending) {
+            LOGGER_DEBUG("pause continuous updates");
+            if (!this->pause_continuous_updates()) {
+                LOGGER_DEBUG("Failed to pause_continuous_updates");
+                return false;
+            }
+        }
+    } else if (this->continuous_updates_paused) {
+        // nothing else is on the way, so the answer is already here unless the link is slower than the viewer
+        while (this->fence_pending && this->wait_for_message(0)) {
+            if (!this->recv_server_to_client_message()) {
+                LOGGER_DEBUG("Failed to recv_server_to_client_message");
+                return false;
+            }
+        }
+        this->fences_in_time = this->fence_pending ? 0 : this->fences_in_time + 1;
+        if (this->fences_in_time >= RESUME_FENCES) {
+            LOGGER_DEBUG("resume continuous updates");
+            this->continuous_updates_paused = false;
+        }
     }
-    if (!this->recv_server_to_client_message()) {
-        LOGGER_DEBUG("Failed to recv_server_to_client_message");
-        return false;
+    // without continuous updates (or after resizing), the frame buffer is requested
+    if (!this->continuous_updates) {
+        // an incremental request stays pending until the server has something to update
+        if (!this->update_requested) {
+            if (!this->send_frame_buffer_update_request()) {
+                LOGGER_DEBUG("Failed to send_frame_buffer_update_request");
+                return false;
+            }
+        }
+        while (this->update_requested) {
+            if (this->frame_buffer_received && !this->wait_for_message(INCREMENTAL_UPDATE_TIMEOUT_MSEC)) {
+                LOGGER_DEBUG("No update, reuse the frame buffer");
+                break;
+            }
+            if (!this->recv_server_to_client_message()) {
+                LOGGER_DEBUG("Failed to recv_server_to_client_message");
+                return false;
+            }
+            if (!this->update_requested && !this->frame_buffer_received) {
+                // the desktop has been resized, wait for its new content
+                if (!this->send_frame_buffer_update_request()) {
+                    LOGGER_DEBUG("Failed to send_frame_buffer_update_request");
+                    return false;
+                }
+            }
+        }
+        // from now on the server pushes the changes, saving a round trip per frame
+        if (this->continuous_updates_supported && this->frame_buffer_received && !this->continuous_updates_paused) {
+            if (!this->send_enable_continuous_updates(true)) {
+                LOGGER_DEBUG("Failed to send_enable_continuous_updates");
+                return false;
+            }
+        }
     }
-    // output image
+    // output image, the pointer is not drawn into it
     if (!this->draw_image()) {
         LOGGER_DEBUG("Failed to draw_image");
         return false;
     }
-    // pointer image
-    uint16_t x = operation.x;
-    uint16_t y = operation.y;
-    if (x == 0 && y == 0) {
-        // no pointer
-        return true;
+    // the answer to this fence by the next capture tells the server is not ahead of the viewer
+    if (this->fence_supported && this->continuous_updates_supported && !this->fence_pending) {
+        if (!this->send_fence_request()) {
+            LOGGER_DEBUG("Failed to send_fence_request");
+            return false;
+        }
+    }
+    return true;
+}
+
+void vnc_client::report_delivery(size_t size, uint32_t microseconds)
+{
+    if (this->image_format != IMAGE_FORMAT_JPEG || !this->controller.is_enabled()) {
+        return;
     }
-    if (!this->draw_pointer(x, y)) {
-        LOGGER_DEBUG("Failed to draw_pointer");
+    this->controller.report(size, microseconds);
+    LOGGER_DEBUG("delivered %d bytes in %d usec, throughput:%d bytes/sec", size, microseconds, (int)this->controller.get_throughput());
+    this->apply_quality_level();
+}
+
+void vnc_client::set_jpeg_quality(int quality)
+{
+    this->encoder.set_quality(quality);
+    this->controller.set_max_quality(quality);
+    this->apply_quality_level();
+}
+
+void vnc_client::set_frame_budget(uint32_t milliseconds)
+{
+    this->controller.set_budget(milliseconds);
+    this->apply_quality_level();
+}
+
+bool vnc_client::set_capture_depth(uint8_t capture_depth)
+{
+    if (capture_depth != 32 && capture_depth != 16 && capture_depth != 8) {
+        LOGGER_DEBUG("unsupported capture_depth:%d", capture_depth);
         return false;
     }
+    this->capture_depth = capture_depth;
     return true;
 }
 
 bool vnc_client::write_jpeg_buf(const std::string path)
 {
-    return cv::imwrite(path, this->image);
+    if (this->jpeg_buf.empty()) {
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*)this->jpeg_buf.data(), this->jpeg_buf.size());
+    return file.good();
 }
 
 //// private /////
 
+const vnc_client::decoder_t *vnc_client::find_decoder(int32_t encoding_type)
+{
+    for (const decoder_t &decoder : DECODERS) {
+        if (decoder.encoding_type == encoding_type) {
+            return &decoder;
+        }
+    }
+    return NULL;
+}
+
 bool vnc_client::recv_server_to_client_message()
 {
-    char buf[BUF_SIZE] = {};
     // recv message type
-    int recv_length = recv(this->sockfd, buf, 1, 0);
-    if (recv_length < 0) {
+    uint8_t message_type = 0;
+    if (!this->recv_exact(&message_type, sizeof(message_type))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
-
-    uint8_t message_type = 0;
-    memmove(&message_type, buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(message_type));
+    LOGGER_XDEBUG(((char*)&message_type), sizeof(message_type));
     switch (message_type) {
     case RFB_MESSAGE_TYPE_FRAME_BUFFER_UPDATE:
         return this->recv_frame_buffer_update();
@@ -652,6 +1100,10 @@ bool vnc_client::recv_server_to_client_message()
         return this->recv_bell();
     case RFB_MESSAGE_TYPE_SERVER_CUT_TEXT:
         return this->recv_server_cut_text();
+    case RFB_MESSAGE_TYPE_END_OF_CONTINUOUS_UPDATES:
+        return this->recv_end_of_continuous_updates();
+    case RFB_MESSAGE_TYPE_FENCE:
+        return this->recv_fence();
     default:
         LOGGER_DEBUG("unexpected message_type:%d", message_type);
         return false;
@@ -659,6 +1111,23 @@ bool vnc_client::recv_server_to_client_message()
     return true;
 }
 
+bool vnc_client::recv_pushed_updates()
+{
+    // take what the server has pushed since the last capture, without waiting for more.
+    // the server keeps sending while the messages are read, so stop at the time limit.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PUSHED_UPDATES_TIMEOUT_MSEC);
+    while (this->continuous_updates && std::chrono::steady_clock::now() < deadline) {
+        if (!this->wait_for_message(0)) {
+            break;
+        }
+        if (!this->recv_server_to_client_message()) {
+            LOGGER_DEBUG("Failed to recv_server_to_client_message");
+            return false;
+        }
+    }
+    return true;
+}
+
 bool vnc_client::recv_rectangles(uint16_t number_of_rectangles)
 {
     for (int i = 0; i < number_of_rectangles; i++) {
@@ -676,26 +1145,178 @@ bool vnc_client::recv_rectangle()
 {
     pixel_data_t pixel_data = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(pixel_data), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&pixel_data, sizeof(pixel_data))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(pixel_data));
+    LOGGER_XDEBUG(((char*)&pixel_data), sizeof(pixel_data));
 
-    memmove(&pixel_data, buf, recv_length);
     uint16_t x_position = ntohs(pixel_data.x_position);
     uint16_t y_position = ntohs(pixel_data.y_position);
     uint16_t width = ntohs(pixel_data.width);
     uint16_t height = ntohs(pixel_data.height);
     LOGGER_DEBUG("(x_position,y_position,width,height)=(%d,%d,%d,%d)",
            x_position, y_position, width, height);
-    int32_t encoding_type = pixel_data.encoding_type;
-    if (encoding_type != RFB_ENCODING_RAW) {
+    int32_t encoding_type = ntohl(pixel_data.encoding_type);
+    LOGGER_DEBUG("encoding_type:%d", encoding_type);
+    // pseudo-encodings whose rectangle is not an area of the frame buffer
+    switch (encoding_type) {
+    case RFB_ENCODING_CURSOR:
+        return this->recv_cursor(x_position, y_position, width, height, false);
+    case RFB_ENCODING_X_CURSOR:
+        return this->recv_cursor(x_position, y_position, width, height, true);
+    case RFB_ENCODING_DESKTOP_SIZE:
+        return this->resize_frame_buffer(width, height);
+    case RFB_ENCODING_EXTENDED_DESKTOP_SIZE:
+        return this->recv_extended_desktop_size(x_position, y_position, width, height);
+    default:
+        break;
+    }
+    const decoder_t *decoder = find_decoder(encoding_type);
+    if (decoder == NULL) {
         LOGGER_DEBUG("unexpected encoding_type:%d", encoding_type);
         return false;
     }
+    if (!this->contains_rectangle(x_position, y_position, width, height)) {
+        LOGGER_DEBUG("rectangle is out of frame buffer");
+        return false;
+    }
+    // a pending passed through JPEG has to be in image_buf before it is updated,
+    // unless the whole frame buffer is overwritten anyway
+    if (encoding_type != RFB_ENCODING_COPY_RECT && width == this->width && height == this->height) {
+        this->tight_jpeg_buf.clear();
+    }
+    if (!this->sync_frame_buffer()) {
+        LOGGER_DEBUG("failed to sync_frame_buffer");
+        return false;
+    }
+    LOGGER_DEBUG("decode %s", decoder->name);
+    if (!(this->*decoder->decode)(x_position, y_position, width, height)) {
+        return false;
+    }
+    this->damage.add(x_position, y_position, width, height);
+    return true;
+}
+
+bool vnc_client::recv_cursor(uint16_t hotspot_x, uint16_t hotspot_y, uint16_t width, uint16_t height, bool x_cursor)
+{
+    LOGGER_DEBUG("cursor (hotspot_x,hotspot_y,width,height)=(%d,%d,%d,%d)", hotspot_x, hotspot_y, width, height);
+    if (width > MAX_CURSOR_SIZE || height > MAX_CURSOR_SIZE) {
+        LOGGER_DEBUG("cursor is too large:%dx%d max:%d", width, height, MAX_CURSOR_SIZE);
+        return false;
+    }
+    size_t pixel_count = (size_t)width * height;
+    size_t mask_stride = (width + 7) / 8;
+    std::vector<uint8_t> bgra(pixel_count * 4);
+    std::vector<uint8_t> bitmask(mask_stride * height);
+    if (x_cursor && pixel_count > 0) {
+        // bitmap selects the primary or the secondary colour
+        x_cursor_t colours = {};
+        std::vector<uint8_t> bitmap(bitmask.size());
+        if (!this->recv_exact(&colours, sizeof(colours)) || !this->recv_exact(bitmap.data(), bitmap.size())) {
+            return false;
+        }
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                bool primary = (bitmap[y * mask_stride + x / 8] >> (7 - x % 8)) & 1;
+                uint8_t *p = &bgra[(y * width + x) * 4];
+                p[0] = primary ? colours.primary_blue : colours.secondary_blue;
+                p[1] = primary ? colours.primary_green : colours.secondary_green;
+                p[2] = primary ? colours.primary_red : colours.secondary_red;
+            }
+        }
+    } else if (!x_cursor) {
+        // pixels are in the pixel format of the frame buffer
+        uint8_t bytes_per_pixel = this->pixel_format.bits_per_pixel / 8;
+        std::vector<uint8_t> pixels(pixel_count * bytes_per_pixel);
+        if (!this->recv_exact(pixels.data(), pixels.size())) {
+            return false;
+        }
+        std::vector<uint32_t> row(width);
+        std::vector<uint8_t> bgr(width * 3);
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                row[x] = this->read_pixel(&pixels[(y * width + x) * bytes_per_pixel]);
+            }
+            this->converter.convert_row(row.data(), bgr.data(), width);
+            for (size_t x = 0; x < width; x++) {
+                memmove(&bgra[(y * width + x) * 4], &bgr[x * 3], 3);
+            }
+        }
+    }
+    if (!this->recv_exact(bitmask.data(), bitmask.size())) {
+        return false;
+    }
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            bool opaque = (bitmask[y * mask_stride + x / 8] >> (7 - x % 8)) & 1;
+            bgra[(y * width + x) * 4 + 3] = opaque ? 0xff : 0x00;
+        }
+    }
+    this->cursor.hotspot_x = hotspot_x;
+    this->cursor.hotspot_y = hotspot_y;
+    this->cursor.width = width;
+    this->cursor.height = height;
+    this->cursor.sequence++;
+    this->cursor_png.clear();
+    if (pixel_count > 0) {
+        // small enough to encode on every change
+        cv::Mat shape(height, width, CV_8UC4, bgra.data());
+        cv::imencode(".png", shape, this->cursor_png);
+    }
+    return true;
+}
+
+bool vnc_client::recv_extended_desktop_size(uint16_t reason, uint16_t status, uint16_t width, uint16_t height)
+{
+    extended_desktop_size_t extended_desktop_size = {};
+    if (!this->recv_exact(&extended_desktop_size, sizeof(extended_desktop_size))) {
+        return false;
+    }
+    LOGGER_DEBUG("reason:%d", reason);
+    LOGGER_DEBUG("status:%d", status);
+    LOGGER_DEBUG("number_of_screens:%d", extended_desktop_size.number_of_screens);
+    for (int i = 0; i < extended_desktop_size.number_of_screens; i++) {
+        screen_t screen = {};
+        if (!this->recv_exact(&screen, sizeof(screen))) {
+            return false;
+        }
+        LOGGER_DEBUG("screen %d:(x_position,y_position,width,height)=(%d,%d,%d,%d)", ntohl(screen.id),
+               ntohs(screen.x_position), ntohs(screen.y_position), ntohs(screen.width), ntohs(screen.height));
+    }
+    if (status != 0) {
+        // answer to a request of a client which failed, nothing has changed
+        return true;
+    }
+    return this->resize_frame_buffer(width, height);
+}
+
+bool vnc_client::resize_frame_buffer(uint16_t width, uint16_t height)
+{
+    LOGGER_DEBUG("resize frame buffer:%dx%d -> %dx%d", this->width, this->height, width, height);
+    if (width == this->width && height == this->height) {
+        // e.g. screens are rearranged in the same frame buffer
+        return true;
+    }
+    if (width == 0 || height == 0 || width > MAX_FRAME_BUFFER_SIZE || height > MAX_FRAME_BUFFER_SIZE) {
+        // e.g. a headless server without a screen, the last frame buffer is kept
+        LOGGER_DEBUG("frame buffer size is out of range, keep %dx%d", this->width, this->height);
+        return true;
+    }
+    this->width = width;
+    this->height = height;
+    this->image_buf.resize(width, height);
+    this->damage.resize(width, height);
+    this->tight_jpeg_buf.clear();
+    // the next request has to be for the whole frame buffer of the new size
+    this->frame_buffer_received = false;
+    // and continuous updates are enabled again for the new size after it
+    this->continuous_updates = false;
+    return true;
+}
+
+bool vnc_client::recv_raw_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
     uint8_t bits_per_pixel = this->pixel_format.bits_per_pixel;
     uint8_t bytes_per_pixel = bits_per_pixel / 8;
     LOGGER_DEBUG("---pixel_format---");
@@ -704,41 +1325,649 @@ bool vnc_client::recv_rectangle()
     LOGGER_DEBUG("------------------");
 
     uint32_t total_pixel_count = width * height;
-    uint32_t total_pixel_bytes = total_pixel_count * bits_per_pixel / 8;
+    uint32_t total_pixel_bytes = total_pixel_count * bytes_per_pixel;
     LOGGER_DEBUG("total_pixel_count:%d", total_pixel_count);
     LOGGER_DEBUG("expected total_pixel_bytes:%d", total_pixel_bytes);
+    if (total_pixel_count == 0) {
+        return true;
+    }
 
-    uint32_t total_recv = 0;
-    while (total_recv < total_pixel_bytes) {
-        memset(buf, 0, sizeof(buf));
-        if (total_pixel_bytes - total_recv < sizeof(buf)) {
-            recv_length = recv(this->sockfd, buf, total_pixel_bytes - total_recv, 0);
-        } else {
-            recv_length = recv(this->sockfd, buf, sizeof(buf), 0);
+    if (bytes_per_pixel == sizeof(uint32_t)) {
+        // pixels go straight to their place in the frame buffer, a row is split at the edges of the tiles
+        std::vector<struct iovec> iov;
+        iov.reserve(height * ((width + frame_buffer::TILE_SIZE - 1) / frame_buffer::TILE_SIZE + 1));
+        for (int y = y_position; y < y_position + height; y++) {
+            uint16_t length = 0;
+            for (int x = 0; x < width; x += length) {
+                uint32_t *span = this->image_buf.get_span(x_position + x, y, &length);
+                length = std::min<uint16_t>(length, width - x);
+                iov.push_back({span, length * sizeof(uint32_t)});
+            }
         }
-        if (recv_length < 0) {
+        return this->recv_exactv(iov.data(), iov.size());
+    }
+    // smaller pixels are widened into the uint32_t containers, a bunch of rows at once
+    uint32_t row_bytes = width * bytes_per_pixel;
+    // at least 1 row, and no more than the rectangle has
+    uint32_t rows_per_recv = std::min<uint32_t>(std::max<uint32_t>(1, RAW_RECV_SIZE / row_bytes), height);
+    this->raw_buf.resize(row_bytes * rows_per_recv);
+    for (uint32_t y = 0; y < height; y += rows_per_recv) {
+        uint32_t rows = std::min<uint32_t>(rows_per_recv, height - y);
+        if (!this->recv_exact(this->raw_buf.data(), row_bytes * rows)) {
             return false;
         }
-        //LOGGER_DEBUG("recv:%d", recv_length);
-        total_recv += recv_length;
-        for (int i = 0; i < recv_length; i+=bytes_per_pixel) {
-            // uint32_t here is just for container of 4bytes, no need to ntohl()
-            uint32_t pixel = 0;
-            memmove(&pixel, &buf[i], sizeof(pixel));
-            this->image_buf.push_back(pixel);
+        this->put_pixels(x_position, y_position + y, width, rows, this->raw_buf.data());
+    }
+    return true;
+}
+
+bool vnc_client::recv_copy_rect_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    copy_rect_t copy_rect = {};
+
+    if (!this->recv_exact(&copy_rect, sizeof(copy_rect))) {
+        return false;
+    }
+    LOGGER_DEBUG("recv:%d", sizeof(copy_rect));
+    LOGGER_XDEBUG(((char*)&copy_rect), sizeof(copy_rect));
+
+    uint16_t src_x_position = ntohs(copy_rect.src_x_position);
+    uint16_t src_y_position = ntohs(copy_rect.src_y_position);
+    LOGGER_DEBUG("(src_x_position,src_y_position)=(%d,%d)", src_x_position, src_y_position);
+    if (!this->contains_rectangle(src_x_position, src_y_position, width, height)) {
+        LOGGER_DEBUG("source rectangle is out of frame buffer");
+        return false;
+    }
+    this->image_buf.copy_rect(src_x_position, src_y_position, x_position, y_position, width, height);
+    return true;
+}
+
+#if MRHC_DECODER_RRE
+bool vnc_client::recv_rre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    return this->decode_rre_rectangle(x_position, y_position, width, height, false);
+}
+
+bool vnc_client::recv_corre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    // subrectangles with 8bit positions and sizes
+    return this->decode_rre_rectangle(x_position, y_position, width, height, true);
+}
+
+bool vnc_client::decode_rre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, bool compact)
+{
+    uint8_t bytes_per_pixel = this->pixel_format.bits_per_pixel / 8;
+    rre_t rre = {};
+    uint8_t buf[BUF_SIZE] = {};
+
+    if (!this->recv_exact(&rre, sizeof(rre))) {
+        return false;
+    }
+    uint32_t number_of_subrectangles = ntohl(rre.number_of_subrectangles);
+    LOGGER_DEBUG("number_of_subrectangles:%d", number_of_subrectangles);
+    if (!this->recv_exact(buf, bytes_per_pixel)) {
+        return false;
+    }
+    this->fill_rectangle(x_position, y_position, width, height, this->read_pixel(buf));
+
+    // CoRRE has 1 byte coordinates relative to the rectangle
+    size_t subrectangle_size = bytes_per_pixel + (compact ? sizeof(corre_subrectangle_t) : sizeof(rre_subrectangle_t));
+    uint32_t subrectangles_per_recv = sizeof(buf) / subrectangle_size;
+    while (number_of_subrectangles > 0) {
+        uint32_t count = std::min(number_of_subrectangles, subrectangles_per_recv);
+        if (!this->recv_exact(buf, count * subrectangle_size)) {
+            return false;
+        }
+        for (uint8_t *subrectangle = buf; subrectangle < buf + count * subrectangle_size; subrectangle += subrectangle_size) {
+            uint32_t pixel = this->read_pixel(subrectangle);
+            uint16_t x, y, w, h;
+            if (compact) {
+                corre_subrectangle_t corre_subrectangle = {};
+                memmove(&corre_subrectangle, subrectangle + bytes_per_pixel, sizeof(corre_subrectangle));
+                x = corre_subrectangle.x_position;
+                y = corre_subrectangle.y_position;
+                w = corre_subrectangle.width;
+                h = corre_subrectangle.height;
+            } else {
+                rre_subrectangle_t rre_subrectangle = {};
+                memmove(&rre_subrectangle, subrectangle + bytes_per_pixel, sizeof(rre_subrectangle));
+                x = ntohs(rre_subrectangle.x_position);
+                y = ntohs(rre_subrectangle.y_position);
+                w = ntohs(rre_subrectangle.width);
+                h = ntohs(rre_subrectangle.height);
+            }
+            if (x + w > width || y + h > height) {
+                LOGGER_DEBUG("subrectangle is out of rectangle");
+                return false;
+            }
+            this->fill_rectangle(x_position + x, y_position + y, w, h, pixel);
+        }
+        number_of_subrectangles -= count;
+    }
+    return true;
+}
+
+#endif
+
+#if MRHC_DECODER_TRLE
+bool vnc_client::recv_trle_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    // same tiles as ZRLE without zlib, read straight from the socket
+    return this->decode_rle_tiles(x_position, y_position, width, height, RFB_TRLE_TILE_SIZE, &vnc_client::recv_exact);
+}
+
+#endif
+
+#if MRHC_DECODER_HEXTILE
+bool vnc_client::recv_hextile_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    uint8_t bytes_per_pixel = this->pixel_format.bits_per_pixel / 8;
+    // background and foreground carry over from the previous tile
+    uint32_t background = 0;
+    uint32_t foreground = 0;
+    // large enough for a raw tile or for 255 coloured subrects
+    uint8_t buf[RFB_HEXTILE_TILE_SIZE * RFB_HEXTILE_TILE_SIZE * sizeof(uint32_t) + 255 * 2] = {};
+
+    for (uint16_t tile_y = 0; tile_y < height; tile_y += RFB_HEXTILE_TILE_SIZE) {
+        uint16_t tile_height = std::min<uint16_t>(RFB_HEXTILE_TILE_SIZE, height - tile_y);
+        for (uint16_t tile_x = 0; tile_x < width; tile_x += RFB_HEXTILE_TILE_SIZE) {
+            uint16_t tile_width = std::min<uint16_t>(RFB_HEXTILE_TILE_SIZE, width - tile_x);
+            uint16_t x = x_position + tile_x;
+            uint16_t y = y_position + tile_y;
+
+            uint8_t subencoding = 0;
+            if (!this->recv_exact(&subencoding, sizeof(subencoding))) {
+                return false;
+            }
+            if (subencoding & RFB_HEXTILE_RAW) {
+                if (!this->recv_exact(buf, tile_width * tile_height * bytes_per_pixel)) {
+                    return false;
+                }
+                this->put_pixels(x, y, tile_width, tile_height, buf);
+                continue;
+            }
+            if (subencoding & RFB_HEXTILE_BACKGROUND_SPECIFIED) {
+                if (!this->recv_exact(buf, bytes_per_pixel)) {
+                    return false;
+                }
+                background = this->read_pixel(buf);
+            }
+            this->fill_rectangle(x, y, tile_width, tile_height, background);
+            if (subencoding & RFB_HEXTILE_FOREGROUND_SPECIFIED) {
+                if (!this->recv_exact(buf, bytes_per_pixel)) {
+                    return false;
+                }
+                foreground = this->read_pixel(buf);
+            }
+            if (!(subencoding & RFB_HEXTILE_ANY_SUBRECTS)) {
+                continue;
+            }
+            uint8_t number_of_subrects = 0;
+            if (!this->recv_exact(&number_of_subrects, sizeof(number_of_subrects))) {
+                return false;
+            }
+            bool coloured = subencoding & RFB_HEXTILE_SUBRECTS_COLOURED;
+            uint8_t subrect_size = coloured ? bytes_per_pixel + 2 : 2;
+            // recv all subrects of the tile at once
+            if (!this->recv_exact(buf, number_of_subrects * subrect_size)) {
+                return false;
+            }
+            for (uint8_t *subrect = buf; subrect < buf + number_of_subrects * subrect_size; subrect += subrect_size) {
+                uint32_t pixel = foreground;
+                if (coloured) {
+                    pixel = this->read_pixel(subrect);
+                }
+                uint8_t x_and_y = subrect[subrect_size - 2];
+                uint8_t width_and_height = subrect[subrect_size - 1];
+                uint16_t subrect_x = x_and_y >> 4;
+                uint16_t subrect_y = x_and_y & 0x0f;
+                uint16_t subrect_width = (width_and_height >> 4) + 1;
+                uint16_t subrect_height = (width_and_height & 0x0f) + 1;
+                if (subrect_x + subrect_width > tile_width || subrect_y + subrect_height > tile_height) {
+                    LOGGER_DEBUG("subrect is out of tile");
+                    return false;
+                }
+                this->fill_rectangle(x + subrect_x, y + subrect_y, subrect_width, subrect_height, pixel);
+            }
+        }
+    }
+    return true;
+}
+
+#endif
+
+#if MRHC_DECODER_ZRLE
+bool vnc_client::recv_zrle_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    zrle_t zrle = {};
+
+    if (!this->recv_exact(&zrle, sizeof(zrle))) {
+        return false;
+    }
+    uint32_t length = ntohl(zrle.length);
+    LOGGER_DEBUG("length:%d", length);
+
+    // the largest a rectangle can be is every tile in plain RLE of one pixel runs after a full palette,
+    // zlib adds a little more to what does not compress and the flush at the end.
+    // the length comes from the server, do not allocate more than that
+    uint8_t cpixel_offset = 0;
+    uint64_t cpixel_size = this->compact_pixel_size(&cpixel_offset);
+    uint64_t tiles = (uint64_t)((width + RFB_ZRLE_TILE_SIZE - 1) / RFB_ZRLE_TILE_SIZE) * ((height + RFB_ZRLE_TILE_SIZE - 1) / RFB_ZRLE_TILE_SIZE);
+    uint64_t max_length = compressBound((uint64_t)width * height * (cpixel_size + 1) + tiles * (1 + 127 * cpixel_size)) + 64;
+    if (length > max_length) {
+        LOGGER_DEBUG("length is too large:%d max:%d", length, max_length);
+        return false;
+    }
+    this->zlib_buf.resize(length);
+    if (!this->recv_exact(this->zlib_buf.data(), length)) {
+        return false;
+    }
+    // the zlib stream lives as long as the connection, the server never resets it
+    if (!this->zrle_stream_initialized) {
+        if (inflateInit(&this->zrle_stream) != Z_OK) {
+            LOGGER_DEBUG("failed to inflateInit");
+            return false;
+        }
+        this->zrle_stream_initialized = true;
+    }
+    if (!this->inflate_buf(&this->zrle_stream, this->zlib_buf, this->zrle_buf)) {
+        LOGGER_DEBUG("failed to inflate");
+        return false;
+    }
+    LOGGER_DEBUG("inflated:%d", this->zrle_buf.size());
+
+    this->zrle_buf_position = 0;
+    return this->decode_rle_tiles(x_position, y_position, width, height, RFB_ZRLE_TILE_SIZE, &vnc_client::read_zrle_buf);
+}
+
+#endif
+
+#if MRHC_DECODER_TRLE || MRHC_DECODER_ZRLE
+bool vnc_client::decode_rle_tiles(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, uint8_t tile_size, read_func_t read)
+{
+    uint8_t cpixel_offset = 0;
+    uint8_t cpixel_size = this->compact_pixel_size(&cpixel_offset);
+    // the palette is kept over tiles, TRLE can reuse the one of the previous tile
+    uint32_t palette[RFB_ZRLE_TILE_SIZE * 2] = {};
+    uint8_t palette_size = 0;
+    uint32_t tile[RFB_ZRLE_TILE_SIZE * RFB_ZRLE_TILE_SIZE] = {};
+    uint8_t buf[RFB_ZRLE_TILE_SIZE * RFB_ZRLE_TILE_SIZE * sizeof(uint32_t)] = {};
+
+    for (uint16_t tile_y = 0; tile_y < height; tile_y += tile_size) {
+        uint16_t tile_height = std::min<uint16_t>(tile_size, height - tile_y);
+        for (uint16_t tile_x = 0; tile_x < width; tile_x += tile_size) {
+            uint16_t tile_width = std::min<uint16_t>(tile_size, width - tile_x);
+            uint16_t x = x_position + tile_x;
+            uint16_t y = y_position + tile_y;
+            uint32_t tile_pixels = tile_width * tile_height;
+
+            uint8_t subencoding = 0;
+            if (!(this->*read)(&subencoding, sizeof(subencoding))) {
+                return false;
+            }
+            bool packed = (subencoding >= 2 && subencoding <= RFB_ZRLE_PACKED_PALETTE_MAX) || subencoding == RFB_TRLE_PACKED_PALETTE_REUSE;
+            bool rle = (subencoding >= RFB_ZRLE_PLAIN_RLE);
+            bool plain = (subencoding == RFB_ZRLE_PLAIN_RLE);
+            bool reuse = (subencoding == RFB_TRLE_PACKED_PALETTE_REUSE || subencoding == RFB_TRLE_PALETTE_RLE_REUSE);
+            if (subencoding == RFB_ZRLE_SOLID) {
+                if (!(this->*read)(buf, cpixel_size)) {
+                    return false;
+                }
+                this->fill_rectangle(x, y, tile_width, tile_height, this->read_compact_pixel(buf, cpixel_size, cpixel_offset));
+                continue;
+            }
+            if (subencoding == RFB_ZRLE_RAW) {
+                if (!(this->*read)(buf, tile_pixels * cpixel_size)) {
+                    return false;
+                }
+                for (uint32_t i = 0; i < tile_pixels; i++) {
+                    tile[i] = this->read_compact_pixel(&buf[i * cpixel_size], cpixel_size, cpixel_offset);
+                }
+            } else if (!packed && !rle) {
+                LOGGER_DEBUG("unexpected subencoding:%d", subencoding);
+                return false;
+            }
+            if ((packed || (rle && !plain)) && !reuse) {
+                palette_size = packed ? subencoding : subencoding - RFB_ZRLE_PLAIN_RLE;
+                if (!(this->*read)(buf, palette_size * cpixel_size)) {
+                    return false;
+                }
+                for (int i = 0; i < palette_size; i++) {
+                    palette[i] = this->read_compact_pixel(&buf[i * cpixel_size], cpixel_size, cpixel_offset);
+                }
+            }
+            if (packed) {
+                // each row is padded to a byte boundary
+                uint8_t bits = (palette_size <= 2) ? 1 : (palette_size <= 4) ? 2 : 4;
+                uint32_t row_bytes = (tile_width * bits + 7) / 8;
+                if (!(this->*read)(buf, row_bytes * tile_height)) {
+                    return false;
+                }
+                for (int j = 0; j < tile_height; j++) {
+                    const uint8_t *row = &buf[row_bytes * j];
+                    for (int i = 0; i < tile_width; i++) {
+                        uint32_t bit = i * bits;
+                        uint8_t index = (row[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+                        if (index >= palette_size) {
+                            LOGGER_DEBUG("palette index is out of range:%d", index);
+                            return false;
+                        }
+                        tile[tile_width * j + i] = palette[index];
+                    }
+                }
+            } else if (rle) {
+                uint32_t i = 0;
+                while (i < tile_pixels) {
+                    uint32_t pixel = 0;
+                    uint32_t run_length = 1;
+                    if (plain) {
+                        if (!(this->*read)(buf, cpixel_size)) {
+                            return false;
+                        }
+                        pixel = this->read_compact_pixel(buf, cpixel_size, cpixel_offset);
+                    } else {
+                        uint8_t index = 0;
+                        if (!(this->*read)(&index, sizeof(index))) {
+                            return false;
+                        }
+                        if ((index & 0x7f) >= palette_size) {
+                            LOGGER_DEBUG("palette index is out of range:%d", index);
+                            return false;
+                        }
+                        pixel = palette[index & 0x7f];
+                        // a palette index without the top bit is a single pixel
+                        if (!(index & 0x80)) {
+                            tile[i++] = pixel;
+                            continue;
+                        }
+                    }
+                    // run length is the sum of bytes until one is not 255, plus one
+                    uint8_t b = 0xff;
+                    while (b == 0xff) {
+                        if (!(this->*read)(&b, sizeof(b))) {
+                            return false;
+                        }
+                        run_length += b;
+                    }
+                    if (run_length > tile_pixels - i) {
+                        LOGGER_DEBUG("run_length is out of tile:%d", run_length);
+                        return false;
+                    }
+                    std::fill(&tile[i], &tile[i + run_length], pixel);
+                    i += run_length;
+                }
+            }
+            for (int j = 0; j < tile_height; j++) {
+                this->image_buf.write_row(x, y + j, tile_width, &tile[tile_width * j]);
+            }
+        }
+    }
+    return true;
+}
+
+#endif
+
+#if MRHC_DECODER_ZRLE
+bool vnc_client::read_zrle_buf(void *buf, size_t length)
+{
+    if (this->zrle_buf_position + length > this->zrle_buf.size()) {
+        LOGGER_DEBUG("zrle data is too short");
+        return false;
+    }
+    memmove(buf, &this->zrle_buf[this->zrle_buf_position], length);
+    this->zrle_buf_position += length;
+    return true;
+}
+
+#endif
+
+#if MRHC_DECODER_TIGHT
+bool vnc_client::recv_tight_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    uint8_t compression_control = 0;
+    if (!this->recv_exact(&compression_control, sizeof(compression_control))) {
+        return false;
+    }
+    LOGGER_DEBUG("compression_control:0x%02x", compression_control);
+    // lower 4 bits request to reset the corresponding zlib streams
+    for (int i = 0; i < RFB_TIGHT_NUMBER_OF_STREAMS; i++) {
+        if ((compression_control & (1 << i)) && this->tight_streams_initialized[i]) {
+            inflateReset(&this->tight_streams[i]);
+        }
+    }
+    uint8_t compression_type = compression_control >> 4;
+    uint8_t tpixel_size = this->tight_pixel_size();
+    uint8_t buf[BUF_SIZE] = {};
+
+    if (compression_type == RFB_TIGHT_FILL) {
+        if (!this->recv_exact(buf, tpixel_size)) {
+            return false;
+        }
+        this->fill_rectangle(x_position, y_position, width, height, this->read_tight_pixel(buf, tpixel_size));
+        return true;
+    }
+    if (compression_type == RFB_TIGHT_JPEG) {
+        return this->recv_tight_jpeg(x_position, y_position, width, height);
+    }
+    if (compression_type > RFB_TIGHT_MAX_BASIC) {
+        LOGGER_DEBUG("unexpected compression_type:%d", compression_type);
+        return false;
+    }
+
+    // basic compression
+    uint8_t stream_id = compression_type & RFB_TIGHT_STREAM_ID_MASK;
+    uint8_t filter_id = RFB_TIGHT_FILTER_COPY;
+    if (compression_type & RFB_TIGHT_EXPLICIT_FILTER) {
+        if (!this->recv_exact(&filter_id, sizeof(filter_id))) {
+            return false;
+        }
+    }
+    LOGGER_DEBUG("(stream_id,filter_id)=(%d,%d)", stream_id, filter_id);
+
+    uint32_t palette[256] = {};
+    uint16_t palette_size = 0;
+    size_t length = 0;
+    switch (filter_id) {
+    case RFB_TIGHT_FILTER_COPY:
+    case RFB_TIGHT_FILTER_GRADIENT:
+        length = width * height * tpixel_size;
+        break;
+    case RFB_TIGHT_FILTER_PALETTE:
+        if (!this->recv_exact(buf, 1)) {
+            return false;
+        }
+        palette_size = buf[0] + 1;
+        if (!this->recv_exact(buf, palette_size * tpixel_size)) {
+            return false;
+        }
+        for (int i = 0; i < palette_size; i++) {
+            palette[i] = this->read_tight_pixel(&buf[i * tpixel_size], tpixel_size);
+        }
+        // 2 colours are packed into bits, each row is padded to a byte boundary
+        length = (palette_size == 2) ? ((width + 7) / 8) * height : width * height;
+        break;
+    default:
+        LOGGER_DEBUG("unexpected filter_id:%d", filter_id);
+        return false;
+    }
+    if (!this->recv_tight_data(stream_id, length, this->tight_buf)) {
+        return false;
+    }
+    const uint8_t *data = this->tight_buf.data();
+    // each row is decoded into row_buf, then written to the tiles
+    this->row_buf.resize(width);
+    uint32_t *row = this->row_buf.data();
+
+    if (filter_id == RFB_TIGHT_FILTER_COPY) {
+        for (int y = y_position; y < y_position + height; y++) {
+            for (int x = 0; x < width; x++) {
+                row[x] = this->read_tight_pixel(data, tpixel_size);
+                data += tpixel_size;
+            }
+            this->image_buf.write_row(x_position, y, width, row);
+        }
+    } else if (filter_id == RFB_TIGHT_FILTER_PALETTE) {
+        size_t row_bytes = (palette_size == 2) ? (width + 7) / 8 : width;
+        for (int y = 0; y < height; y++) {
+            const uint8_t *indexes = &data[row_bytes * y];
+            for (int x = 0; x < width; x++) {
+                uint8_t index = (palette_size == 2) ? (indexes[x / 8] >> (7 - x % 8)) & 0x01 : indexes[x];
+                if (index >= palette_size) {
+                    LOGGER_DEBUG("palette index is out of range:%d", index);
+                    return false;
+                }
+                row[x] = palette[index];
+            }
+            this->image_buf.write_row(x_position, y_position + y, width, row);
+        }
+    } else {
+        // gradient: each component is the difference from left + upper - upper left
+        uint16_t max[3] = {
+            ntohs(this->pixel_format.red_max),
+            ntohs(this->pixel_format.green_max),
+            ntohs(this->pixel_format.blue_max),
+        };
+        std::vector<uint16_t> upper_row((width + 1) * 3, 0);
+        std::vector<uint16_t> this_row((width + 1) * 3, 0);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint16_t diff[3] = {};
+                this->split_pixel(this->read_tight_pixel(data, tpixel_size), &diff[0], &diff[1], &diff[2]);
+                data += tpixel_size;
+                // index 0 is the virtual column left of the rectangle, always 0
+                uint16_t *left = &this_row[x * 3];
+                uint16_t *upper = &upper_row[(x + 1) * 3];
+                uint16_t *upper_left = &upper_row[x * 3];
+                uint16_t *current = &this_row[(x + 1) * 3];
+                for (int c = 0; c < 3; c++) {
+                    int predicted = left[c] + upper[c] - upper_left[c];
+                    predicted = std::min<int>(std::max<int>(predicted, 0), max[c]);
+                    current[c] = (predicted + diff[c]) & max[c];
+                }
+                row[x] = this->make_pixel(current[0], current[1], current[2]);
+            }
+            this->image_buf.write_row(x_position, y_position + y, width, row);
+            upper_row.swap(this_row);
+        }
+    }
+    return true;
+}
+
+bool vnc_client::recv_tight_data(uint8_t stream_id, size_t length, std::vector<uint8_t> &data)
+{
+    // too small data is sent without compression
+    if (length < RFB_TIGHT_MIN_TO_COMPRESS) {
+        data.resize(length);
+        return this->recv_exact(data.data(), length);
+    }
+    uint32_t compressed_length = 0;
+    if (!this->recv_compact_length(&compressed_length)) {
+        return false;
+    }
+    this->zlib_buf.resize(compressed_length);
+    if (!this->recv_exact(this->zlib_buf.data(), compressed_length)) {
+        return false;
+    }
+    z_stream *stream = &this->tight_streams[stream_id];
+    if (!this->tight_streams_initialized[stream_id]) {
+        if (inflateInit(stream) != Z_OK) {
+            LOGGER_DEBUG("failed to inflateInit");
+            return false;
+        }
+        this->tight_streams_initialized[stream_id] = true;
+    }
+    if (!this->inflate_buf(stream, this->zlib_buf, data)) {
+        LOGGER_DEBUG("failed to inflate");
+        return false;
+    }
+    if (data.size() != length) {
+        LOGGER_DEBUG("unexpected inflated length:%d", data.size());
+        return false;
+    }
+    return true;
+}
+
+bool vnc_client::recv_tight_jpeg(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height)
+{
+    uint32_t length = 0;
+    if (!this->recv_compact_length(&length)) {
+        return false;
+    }
+    LOGGER_DEBUG("jpeg length:%d", length);
+    std::vector<uint8_t> jpeg(length);
+    if (!this->recv_exact(jpeg.data(), length)) {
+        return false;
+    }
+    if (x_position == 0 && y_position == 0 && width == this->width && height == this->height) {
+        // the server already compressed the whole frame, it can be sent as it is
+        LOGGER_DEBUG("pass through jpeg");
+        this->tight_jpeg_buf.swap(jpeg);
+        return true;
+    }
+    return this->decode_jpeg(x_position, y_position, width, height, jpeg);
+}
+
+bool vnc_client::recv_compact_length(uint32_t *length)
+{
+    // 1 to 3 bytes, 7 bits in each byte except the 3rd with the top bit telling to continue
+    *length = 0;
+    for (int i = 0; i < 3; i++) {
+        uint8_t b = 0;
+        if (!this->recv_exact(&b, sizeof(b))) {
+            return false;
+        }
+        if (i == 2) {
+            *length |= b << 14;
+            break;
+        }
+        *length |= (b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            break;
         }
     }
-    LOGGER_DEBUG("total_recv reached total_pixel_bytes:%d", total_recv);
-    LOGGER_DEBUG("image_buf size:%d", this->image_buf.size());
+    return true;
+}
+
+#endif
 
+bool vnc_client::decode_jpeg(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, const std::vector<uint8_t> &jpeg)
+{
+    cv::Mat decoded = cv::imdecode(cv::Mat(1, jpeg.size(), CV_8UC1, (void*)jpeg.data()), cv::IMREAD_COLOR);
+    if (decoded.empty() || decoded.cols != width || decoded.rows != height) {
+        LOGGER_DEBUG("failed to decode jpeg");
+        return false;
+    }
+    uint16_t red_max = ntohs(this->pixel_format.red_max);
+    uint16_t green_max = ntohs(this->pixel_format.green_max);
+    uint16_t blue_max = ntohs(this->pixel_format.blue_max);
+    this->row_buf.resize(width);
+    uint32_t *row = this->row_buf.data();
+    for (int y = 0; y < height; y++) {
+        const uint8_t *bgr = decoded.ptr<uint8_t>(y);
+        for (int x = 0; x < width; x++) {
+            row[x] = this->make_pixel(bgr[2] * red_max / 255, bgr[1] * green_max / 255, bgr[0] * blue_max / 255);
+            bgr += 3;
+        }
+        this->image_buf.write_row(x_position, y_position + y, width, row);
+    }
     return true;
 }
 
-bool vnc_client::recv_colours(uint16_t number_of_colours)
+bool vnc_client::sync_frame_buffer()
+{
+    if (this->tight_jpeg_buf.empty()) {
+        return true;
+    }
+    std::vector<uint8_t> jpeg;
+    jpeg.swap(this->tight_jpeg_buf);
+    return this->decode_jpeg(0, 0, this->width, this->height, jpeg);
+}
+
+bool vnc_client::recv_colours(uint16_t first_colour, uint16_t number_of_colours)
 {
     for (int i = 0; i < number_of_colours; i++) {
         LOGGER_DEBUG("--start recv_colours:%d", i + 1);
-        if (!this->recv_colour()) {
+        if (!this->recv_colour(first_colour + i)) {
             LOGGER_DEBUG("failed to recv_colour");
             return false;
         }
@@ -747,29 +1976,33 @@ bool vnc_client::recv_colours(uint16_t number_of_colours)
     return true;
 }
 
-bool vnc_client::recv_colour()
+bool vnc_client::recv_colour(uint16_t index)
 {
     colour_data_t colour_data = {};
 
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, sizeof(colour_data), 0);
-    if (recv_length < 0) {
+    if (!this->recv_exact(&colour_data, sizeof(colour_data))) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_XDEBUG(buf, recv_length);
+    LOGGER_DEBUG("recv:%d", sizeof(colour_data));
+    LOGGER_XDEBUG(((char*)&colour_data), sizeof(colour_data));
+
+    // only 8bpp indexes are used
+    if (index > UINT8_MAX) {
+        LOGGER_DEBUG("discarded");
+        return true;
+    }
+    this->converter.set_colour(index, ntohs(colour_data.red), ntohs(colour_data.green), ntohs(colour_data.blue));
     return true;
 }
 
 bool vnc_client::recv_text(uint32_t length)
 {
-    char buf[BUF_SIZE] = {};
-    int recv_length = recv(this->sockfd, buf, length, 0);
-    if (recv_length < 0) {
+    std::string text(length, '\0');
+    if (!this->recv_exact(&text[0], length)) {
         return false;
     }
-    LOGGER_DEBUG("recv:%d", recv_length);
-    LOGGER_DEBUG(buf);
+    LOGGER_DEBUG("recv:%d", length);
+    LOGGER_DEBUG(text.c_str());
     return true;
 }
 
@@ -799,8 +2032,189 @@ const uint32_t vnc_client::convert_key_to_code(std::string key)
     return key_code;
 }
 
+bool vnc_client::recv_exact(void *buf, size_t length)
+{
+    // recv() may return less than requested, the reader loops until the whole length arrives
+    if (!this->reader.read_exact(buf, length)) {
+        LOGGER_DEBUG("Failed to read %d bytes:%s", length, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool vnc_client::recv_exactv(struct iovec *iov, int iovcnt)
+{
+    if (!this->reader.read_exactv(iov, iovcnt)) {
+        LOGGER_DEBUG("Failed to read into %d buffers:%s", iovcnt, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool vnc_client::wait_for_message(int timeout_msec)
+{
+    // a message may already be in the buffer of the reader
+    return this->reader.wait_readable(timeout_msec);
+}
+
+bool vnc_client::contains_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height) const
+{
+    return (x_position + width <= this->width) && (y_position + height <= this->height);
+}
+
+uint32_t vnc_client::read_pixel(const uint8_t *buf) const
+{
+    // uint32_t here is just for container of 4bytes, no need to ntohl()
+    uint32_t pixel = 0;
+    memmove(&pixel, buf, this->pixel_format.bits_per_pixel / 8);
+    return pixel;
+}
+
+uint8_t vnc_client::compact_pixel_size(uint8_t *offset) const
+{
+    // CPIXEL is 3 bytes if all colours of a 32bpp true colour pixel fit in either 3 bytes
+    if (this->pixel_format.true_colour_flag && this->pixel_format.bits_per_pixel == 32 && this->pixel_format.depth <= 24) {
+        uint32_t mask = (ntohs(this->pixel_format.red_max) << this->pixel_format.red_shift)
+            | (ntohs(this->pixel_format.green_max) << this->pixel_format.green_shift)
+            | (ntohs(this->pixel_format.blue_max) << this->pixel_format.blue_shift);
+        bool least_significant = (mask & 0xff000000) == 0;
+        if (least_significant || (mask & 0x000000ff) == 0) {
+            // the 3 bytes are at the head of the pixel bytes when they are on the first byte side in wire order
+            if (offset != NULL) {
+                *offset = (least_significant != (bool)this->pixel_format.big_endian_flag) ? 0 : 1;
+            }
+            return 3;
+        }
+    }
+    if (offset != NULL) {
+        *offset = 0;
+    }
+    return this->pixel_format.bits_per_pixel / 8;
+}
+
+uint32_t vnc_client::read_compact_pixel(const uint8_t *buf, uint8_t size, uint8_t offset) const
+{
+    uint32_t pixel = 0;
+    memmove((uint8_t*)&pixel + offset, buf, size);
+    return pixel;
+}
+
+uint8_t vnc_client::tight_pixel_size() const
+{
+    // TPIXEL is 3 bytes of R, G, B for 32bpp true colour with depth 24 and 8 bits colours
+    if (this->pixel_format.true_colour_flag && this->pixel_format.bits_per_pixel == 32 && this->pixel_format.depth == 24
+        && ntohs(this->pixel_format.red_max) == 0xff
+        && ntohs(this->pixel_format.green_max) == 0xff
+        && ntohs(this->pixel_format.blue_max) == 0xff) {
+        return 3;
+    }
+    return this->pixel_format.bits_per_pixel / 8;
+}
+
+uint32_t vnc_client::read_tight_pixel(const uint8_t *buf, uint8_t size) const
+{
+    if (size == 3) {
+        return this->make_pixel(buf[0], buf[1], buf[2]);
+    }
+    return this->read_pixel(buf);
+}
+
+uint32_t vnc_client::make_pixel(uint16_t red, uint16_t green, uint16_t blue) const
+{
+    uint32_t value = (red << this->pixel_format.red_shift)
+        | (green << this->pixel_format.green_shift)
+        | (blue << this->pixel_format.blue_shift);
+    if (!this->pixel_format.big_endian_flag) {
+        return value;
+    }
+    // image_buf keeps the pixel bytes in wire order
+    switch (this->pixel_format.bits_per_pixel) {
+    case 32:
+        return __builtin_bswap32(value);
+    case 16:
+        return __builtin_bswap16(value);
+    default:
+        return value;
+    }
+}
+
+void vnc_client::split_pixel(uint32_t pixel, uint16_t *red, uint16_t *green, uint16_t *blue) const
+{
+    // make_pixel() is its own inverse regarding the byte order
+    uint32_t value = pixel;
+    if (this->pixel_format.big_endian_flag) {
+        value = (this->pixel_format.bits_per_pixel == 32) ? __builtin_bswap32(pixel)
+            : (this->pixel_format.bits_per_pixel == 16) ? __builtin_bswap16(pixel) : pixel;
+    }
+    *red = (value >> this->pixel_format.red_shift) & ntohs(this->pixel_format.red_max);
+    *green = (value >> this->pixel_format.green_shift) & ntohs(this->pixel_format.green_max);
+    *blue = (value >> this->pixel_format.blue_shift) & ntohs(this->pixel_format.blue_max);
+}
+
+bool vnc_client::inflate_buf(z_stream *stream, const std::vector<uint8_t> &in, std::vector<uint8_t> &out)
+{
+    stream->next_in = (Bytef*)in.data();
+    stream->avail_in = in.size();
+    size_t total_out = 0;
+    out.resize(std::max<size_t>(out.capacity(), std::max<size_t>(in.size() * 4, BUF_SIZE)));
+    while (true) {
+        if (total_out == out.size()) {
+            out.resize(out.size() * 2);
+        }
+        stream->next_out = &out[total_out];
+        stream->avail_out = out.size() - total_out;
+        int ret = inflate(stream, Z_SYNC_FLUSH);
+        total_out = out.size() - stream->avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOGGER_DEBUG("inflate error:%d", ret);
+            return false;
+        }
+        // all input is consumed and all output is flushed
+        if (stream->avail_in == 0 && stream->avail_out > 0) {
+            break;
+        }
+    }
+    out.resize(total_out);
+    return true;
+}
+
+void vnc_client::fill_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, uint32_t pixel)
+{
+    this->image_buf.fill_rect(x_position, y_position, width, height, pixel);
+}
+
+void vnc_client::put_pixels(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, const uint8_t *buf)
+{
+    uint8_t bytes_per_pixel = this->pixel_format.bits_per_pixel / 8;
+    this->row_buf.resize(width);
+    uint32_t *row = this->row_buf.data();
+    for (int y = y_position; y < y_position + height; y++) {
+        for (int x = 0; x < width; x++) {
+            row[x] = this->read_pixel(buf);
+            buf += bytes_per_pixel;
+        }
+        this->image_buf.write_row(x_position, y, width, row);
+    }
+}
+
 bool vnc_client::draw_image()
 {
+    uint16_t image_width = this->get_image_width();
+    uint16_t image_height = this->get_image_height();
+    bool scaled = (image_width != this->width || image_height != this->height);
+    if (this->image_format != this->drawn_format || image_width != this->drawn_width || image_height != this->drawn_height) {
+        // images encoded for another format or size are not reused even without damage
+        this->jpeg_buf.clear();
+        this->imencode_buf.clear();
+        this->drawn_format = this->image_format;
+        this->drawn_width = image_width;
+        this->drawn_height = image_height;
+    }
+    if (this->image_format == IMAGE_FORMAT_JPEG && !scaled && !this->tight_jpeg_buf.empty()) {
+        // no need to decode and encode again
+        this->jpeg_buf = this->tight_jpeg_buf;
+        return true;
+    }
     uint8_t bits_per_pixel   = this->pixel_format.bits_per_pixel;
     uint8_t depth            = this->pixel_format.depth;
     uint8_t big_endian_flag  = this->pixel_format.big_endian_flag;
@@ -825,43 +2239,129 @@ bool vnc_client::draw_image()
     LOGGER_DEBUG("blue_shift:%d",       blue_shift);
     LOGGER_DEBUG("------------------");
 
-    this->image = cv::Mat(this->height, this->width, CV_8UC3, cv::Scalar(0, 0, 0));
+    if (this->image_format != IMAGE_FORMAT_JPEG || scaled) {
+        return this->encode_image();
+    }
+    std::vector<damage_rect_t> rects;
+    if (this->planes.get_width() != this->width || this->planes.get_height() != this->height ||
+        this->planes.get_subsampling() != this->encoder.get_subsampling()) {
+        this->planes.resize(this->width, this->height, this->encoder.get_subsampling());
+        rects.push_back({0, 0, this->width, this->height});
+    } else {
+        // only the area changed since the last drawing needs to be converted
+        rects = this->damage.get_rects(this->planes_sequence);
+    }
+    if (rects.empty() && !this->jpeg_buf.empty()) {
+        LOGGER_DEBUG("no damage, reuse jpeg");
+        return true;
+    }
     LOGGER_DEBUG("%dx%d", this->width, this->height);
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            uint32_t pixel = this->image_buf[this->width * y + x];
-            uint8_t red = ((pixel >> red_shift) & red_max);
-            uint8_t green = ((pixel >> green_shift) & green_max);
-            uint8_t blue = ((pixel >> blue_shift) & blue_max);
-            //LOGGER_DEBUG("(R,G,B)=(%d,%d,%d)", red, green, blue);
-            rectangle(this->image, cv::Point(x, y), cv::Point(x+1, y+1), cv::Scalar(blue, green, red), -1, CV_AA);
-        }
+    for (size_t i = 0; i < rects.size(); i++) {
+        const damage_rect_t &rect = rects[i];
+        LOGGER_DEBUG("(x,y,width,height)=(%d,%d,%d,%d)", rect.x, rect.y, rect.width, rect.height);
+        // the planes keep the rest of the frame in YCbCr, and the bands over the rest are kept compressed
+        this->planes.update(this->image_buf, this->converter, rect.x, rect.y, rect.width, rect.height);
+        this->encoder.invalidate(rect.y, rect.height);
+    }
+    this->planes_sequence = this->damage.get_sequence();
+    if (!this->encoder.encode(this->planes, this->jpeg_buf)) {
+        LOGGER_DEBUG("failed to encode jpeg:%s", this->encoder.get_error().c_str());
+        return false;
     }
-    cv::imencode(".jpeg", this->image, this->jpeg_buf);
     return true;
 }
 
-bool vnc_client::draw_pointer(uint16_t x, uint16_t y)
+bool vnc_client::encode_image()
 {
-    if (x == 0 && y == 0) {
+    // a JPEG passed through from the server is needed in the frame buffer now
+    if (!this->sync_frame_buffer()) {
+        LOGGER_DEBUG("failed to sync_frame_buffer");
+        return false;
+    }
+    uint16_t width = this->get_image_width();
+    uint16_t height = this->get_image_height();
+    bool scaled = (width != this->width || height != this->height);
+    std::vector<damage_rect_t> rects;
+    if (this->image.empty() || this->image.cols != width || this->image.rows != height ||
+        this->scaler.get_src_width() != this->width || this->scaler.get_src_height() != this->height) {
+        this->image = cv::Mat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
+        this->scaler.resize(this->width, this->height, width, height);
+        rects.push_back({0, 0, width, height});
+    } else {
+        // the boxes over the damage when scaled
+        rects = this->damage.get_rects(this->image_sequence);
+        for (size_t i = 0; scaled && i < rects.size(); i++) {
+            this->scaler.map_area(&rects[i].x, &rects[i].y, &rects[i].width, &rects[i].height);
+        }
+    }
+    std::vector<uint8_t> &out = (this->image_format == IMAGE_FORMAT_JPEG) ? this->jpeg_buf : this->imencode_buf;
+    if (rects.empty() && !out.empty()) {
+        LOGGER_DEBUG("no damage, reuse image");
+        return true;
+    }
+    for (size_t i = 0; i < rects.size(); i++) {
+        const damage_rect_t &rect = rects[i];
+        LOGGER_DEBUG("(x,y,width,height)=(%d,%d,%d,%d)", rect.x, rect.y, rect.width, rect.height);
+        // whatever format is drawn now, a scaled JPEG later is compressed from this image
+        this->encoder.invalidate(rect.y, rect.height);
+        if (scaled) {
+            this->scaler.scale(this->image_buf, this->converter, rect.x, rect.y, rect.width, rect.height, this->image.data, this->image.step);
+            continue;
+        }
+        // gathered from the tiles first, the converter works best on long rows
+        this->row_buf.resize(rect.width);
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            this->image_buf.read_row(rect.x, y, rect.width, this->row_buf.data());
+            this->converter.convert_row(this->row_buf.data(), this->image.ptr<uint8_t>(y) + rect.x * 3, rect.width);
+        }
+    }
+    this->image_sequence = this->damage.get_sequence();
+    if (this->image_format == IMAGE_FORMAT_JPEG) {
+        if (!this->encoder.encode(this->image.data, width, height, this->image.step, this->jpeg_buf)) {
+            LOGGER_DEBUG("failed to encode jpeg:%s", this->encoder.get_error().c_str());
+            return false;
+        }
         return true;
     }
-    for (int d = 0; d < 5; d++) {
-        uint16_t left_x = x - d;
-        uint16_t right_x = x + d;
-        uint16_t upper_y = y - d;
-        uint16_t lower_y = y + d;
-        rectangle(this->image, cv::Point(left_x, upper_y), cv::Point(left_x+1, upper_y+1), cv::Scalar(0, 0, 0), -1, CV_AA);
-        rectangle(this->image, cv::Point(right_x, upper_y), cv::Point(right_x+1, upper_y+1), cv::Scalar(0, 0, 0), -1, CV_AA);
-        rectangle(this->image, cv::Point(left_x, lower_y), cv::Point(left_x+1, lower_y+1), cv::Scalar(0, 0, 0), -1, CV_AA);
-        rectangle(this->image, cv::Point(right_x, lower_y), cv::Point(right_x+1, lower_y+1), cv::Scalar(0, 0, 0), -1, CV_AA);
+    std::string extension = ".png";
+    std::vector<int> params = {cv::IMWRITE_PNG_COMPRESSION, this->png_compression};
+    if (this->image_format == IMAGE_FORMAT_WEBP || this->image_format == IMAGE_FORMAT_WEBP_LOSSLESS) {
+        extension = ".webp";
+        params = {cv::IMWRITE_WEBP_QUALITY,
+                  (this->image_format == IMAGE_FORMAT_WEBP) ? this->webp_quality : WEBP_LOSSLESS_QUALITY};
+    }
+    if (!cv::imencode(extension, this->image, this->imencode_buf, params)) {
+        LOGGER_DEBUG("failed to encode %s", extension.c_str());
+        this->imencode_buf.clear();
+        return false;
     }
-    cv::imencode(".jpeg", this->image, this->jpeg_buf);
     return true;
 }
 
+void vnc_client::apply_quality_level()
+{
+    if (!this->controller.is_enabled()) {
+        return;
+    }
+    const quality_controller::level_t &level = this->controller.get_level();
+    if (level.quality == this->encoder.get_quality() && level.subsampling == this->encoder.get_subsampling()) {
+        return;
+    }
+    LOGGER_DEBUG("jpeg quality:%d subsampling:%s", level.quality,
+                 (level.subsampling == ycbcr_planes::SUBSAMPLING_444) ? "4:4:4" : "4:2:0");
+    this->encoder.set_quality(level.quality);
+    this->encoder.set_subsampling(level.subsampling);
+    // the next frame is encoded in the new level even without damage, every band is compressed again
+    this->jpeg_buf.clear();
+}
+
 void vnc_client::clear_buf()
 {
-    this->image_buf.clear();
+    // image_buf is the framebuffer of the session, keep it to apply the next rectangles,
+    // only force the next draw_image() to convert and encode the whole frame again
     this->jpeg_buf.clear();
+    this->planes.resize(0, 0);
+    this->imencode_buf.clear();
+    this->image.release();
+    this->encoder.invalidate_all();
 }
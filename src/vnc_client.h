@@ -2,9 +2,37 @@
 #define __VNC_CLIENT_H__
 
 
+#include <zlib.h>
+
 #include "opencv2/core/core.hpp"
 
+#include "damage_region.h"
+#include "frame_buffer.h"
+#include "image_scaler.h"
+#include "jpeg_encoder.h"
+#include "pixel_converter.h"
+#include "quality_controller.h"
 #include "rfb_protocol.h"
+#include "socket_reader.h"
+#include "ycbcr_planes.h"
+
+// decoders to compile in, e.g. -DMRHC_DECODER_TIGHT=0 leaves Tight out of the build.
+// Raw and CopyRect are always compiled in.
+#ifndef MRHC_DECODER_RRE
+#define MRHC_DECODER_RRE 1
+#endif
+#ifndef MRHC_DECODER_HEXTILE
+#define MRHC_DECODER_HEXTILE 1
+#endif
+#ifndef MRHC_DECODER_TRLE
+#define MRHC_DECODER_TRLE 1
+#endif
+#ifndef MRHC_DECODER_ZRLE
+#define MRHC_DECODER_ZRLE 1
+#endif
+#ifndef MRHC_DECODER_TIGHT
+#define MRHC_DECODER_TIGHT 1
+#endif
 
 typedef struct vnc_operation {
     uint16_t x;
@@ -13,10 +41,28 @@ typedef struct vnc_operation {
     std::string key;
 } vnc_operation_t;
 
+// what draw_image() encodes the frame buffer into
+typedef enum image_format {
+    IMAGE_FORMAT_JPEG,
+    IMAGE_FORMAT_WEBP,
+    IMAGE_FORMAT_WEBP_LOSSLESS,
+    IMAGE_FORMAT_PNG,
+} image_format_t;
+
+typedef struct vnc_cursor {
+    uint16_t hotspot_x;
+    uint16_t hotspot_y;
+    uint16_t width;
+    uint16_t height;
+    // counted up by each change of the shape
+    uint32_t sequence;
+} vnc_cursor_t;
+
 class vnc_client
 {
  private:
     int sockfd;
+    socket_reader reader;
 
     // for connection
     std::string host;
@@ -30,25 +76,147 @@ class vnc_client
     uint16_t width = 0;
     uint16_t height = 0;
     pixel_format_t pixel_format;
+    // native format announced by ServerInit
+    pixel_format_t server_pixel_format = {};
+    bool native_pixel_format = false;
+    // bits per pixel to request by SetPixelFormat
+    uint8_t capture_depth = 32;
+    // request 8bpp indexes of the colour map instead of true colour
+    bool colour_map = false;
     std::string name;
     // output
-    cv::Mat image;
-    std::vector<uint32_t> image_buf;
+    frame_buffer image_buf;
+    // YCbCr of image_buf, converted only where it has changed
+    ycbcr_planes planes;
     std::vector<uint8_t> jpeg_buf;
+    pixel_converter converter;
+    jpeg_encoder encoder;
+    // quality and subsampling of the encoder by the delivery of the frames
+    quality_controller controller;
+    image_format_t image_format = IMAGE_FORMAT_JPEG;
+    // size of the image to the frame buffer, 1 or less
+    double image_scale = 1;
+    image_scaler scaler;
+    // BGR of image_buf at the size of the image, for the formats encoded by OpenCV and for scaled JPEG
+    cv::Mat image;
+    std::vector<uint8_t> imencode_buf;
+    // format and size of the last image drawn, the encoded images are only reused for the same ones
+    image_format_t drawn_format = IMAGE_FORMAT_JPEG;
+    uint16_t drawn_width = 0;
+    uint16_t drawn_height = 0;
+    int webp_quality = DEFAULT_WEBP_QUALITY;
+    int png_compression = DEFAULT_PNG_COMPRESSION;
+    // frame buffer update
+    bool frame_buffer_received = false;
+    bool update_requested = false;
+    // ContinuousUpdates, the server pushes the changes of the whole frame buffer without requests
+    bool continuous_updates_supported = false;
+    bool continuous_updates = false;
+    // paused while the server pushes more than the viewer takes, told by the answers to fences
+    bool continuous_updates_paused = false;
+    int fences_in_time = 0;
+    // Fence, a request after each frame is answered by the server after the updates sent before it
+    bool fence_supported = false;
+    bool fence_pending = false;
+    uint32_t fence_sequence = 0;
+    damage_region damage;
+    // frame sequences drawn into planes and image last time
+    uint32_t planes_sequence = 0;
+    uint32_t image_sequence = 0;
+    // cursor is drawn by the browser, not into the image
+    vnc_cursor_t cursor = {};
+    std::vector<uint8_t> cursor_png;
+    uint16_t pointer_x = 0;
+    uint16_t pointer_y = 0;
+    // decoding
+    std::vector<int32_t> encoding_types;
+    std::vector<uint8_t> raw_buf;
+    // a row decoded before it is written to the tiles of image_buf
+    std::vector<uint32_t> row_buf;
+    z_stream zrle_stream;
+    bool zrle_stream_initialized = false;
+    std::vector<uint8_t> zlib_buf;
+    std::vector<uint8_t> zrle_buf;
+    size_t zrle_buf_position = 0;
+    z_stream tight_streams[RFB_TIGHT_NUMBER_OF_STREAMS];
+    bool tight_streams_initialized[RFB_TIGHT_NUMBER_OF_STREAMS] = {};
+    std::vector<uint8_t> tight_buf;
+    // a JPEG covering the whole frame buffer, passed through to jpeg_buf without re-encoding
+    // and decoded into image_buf only when it is needed
+    std::vector<uint8_t> tight_jpeg_buf;
+
+    typedef bool (vnc_client::*read_func_t)(void *buf, size_t length);
+    typedef bool (vnc_client::*decode_func_t)(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    typedef struct decoder {
+        int32_t encoding_type;
+        const char *name;
+        decode_func_t decode;
+    } decoder_t;
+    // rectangle decoders compiled in, looked up by recv_rectangle()
+    static const std::vector<decoder_t> DECODERS;
+    static const decoder_t *find_decoder(int32_t encoding_type);
 
     bool recv_server_to_client_message();
+    bool recv_pushed_updates();
     bool recv_rectangles(uint16_t number_of_rectangles);
     bool recv_rectangle();
-    bool recv_colours(uint16_t number_of_colours);
-    bool recv_colour();
+    bool recv_cursor(uint16_t hotspot_x, uint16_t hotspot_y, uint16_t width, uint16_t height, bool x_cursor);
+    bool recv_extended_desktop_size(uint16_t reason, uint16_t status, uint16_t width, uint16_t height);
+    bool resize_frame_buffer(uint16_t width, uint16_t height);
+    bool recv_raw_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_copy_rect_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_rre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_corre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool decode_rre_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, bool compact);
+    bool recv_trle_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_hextile_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_zrle_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool decode_rle_tiles(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, uint8_t tile_size, read_func_t read);
+    bool read_zrle_buf(void *buf, size_t length);
+    bool recv_tight_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_tight_data(uint8_t stream_id, size_t length, std::vector<uint8_t> &data);
+    bool recv_tight_jpeg(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height);
+    bool recv_compact_length(uint32_t *length);
+    bool decode_jpeg(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, const std::vector<uint8_t> &jpeg);
+    bool sync_frame_buffer();
+    bool recv_colours(uint16_t first_colour, uint16_t number_of_colours);
+    bool recv_colour(uint16_t index);
     bool recv_text(uint32_t length);
     const uint32_t convert_key_to_code(std::string key);
+    bool recv_exact(void *buf, size_t length);
+    bool recv_exactv(struct iovec *iov, int iovcnt);
+    bool wait_for_message(int timeout_msec);
+    bool contains_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height) const;
+    uint32_t read_pixel(const uint8_t *buf) const;
+    uint8_t compact_pixel_size(uint8_t *offset = NULL) const;
+    uint32_t read_compact_pixel(const uint8_t *buf, uint8_t size, uint8_t offset) const;
+    uint8_t tight_pixel_size() const;
+    uint32_t read_tight_pixel(const uint8_t *buf, uint8_t size) const;
+    bool is_native_pixel_format_usable() const;
+    uint32_t make_pixel(uint16_t red, uint16_t green, uint16_t blue) const;
+    void split_pixel(uint32_t pixel, uint16_t *red, uint16_t *green, uint16_t *blue) const;
+    bool inflate_buf(z_stream *stream, const std::vector<uint8_t> &in, std::vector<uint8_t> &out);
+    void fill_rectangle(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, uint32_t pixel);
+    void put_pixels(uint16_t x_position, uint16_t y_position, uint16_t width, uint16_t height, const uint8_t *buf);
+    // formats other than JPEG and scaled images, from the BGR image
+    bool encode_image();
+    void apply_quality_level();
  public:
     static const std::string KEY_BACKSPACE;
     static const std::string KEY_PERIOD;
     static const std::string KEY_ENTER;
     static const std::string KEY_SPACE;
     static const std::string KEY_SLASH;
+    static const std::vector<int32_t> DEFAULT_ENCODING_TYPES;
+    static const int DEFAULT_WEBP_QUALITY = 80;
+    static const int DEFAULT_PNG_COMPRESSION = 1;
+
+    // encoding type by name such as "zrle", "cursor", "quality=6" or "compress=2",
+    // false if the name is unknown or its decoder is not compiled in
+    static bool parse_encoding_type(const std::string name, int32_t *encoding_type);
+    static bool is_encoding_type_supported(int32_t encoding_type);
+    // image format by name: "jpeg", "webp", "webp-lossless" or "png"
+    static bool parse_image_format(const std::string name, image_format_t *image_format);
 
     vnc_client(std::string host, int port, std::string password);
     ~vnc_client();
@@ -58,14 +226,55 @@ class vnc_client
     bool configure();
     bool operate(vnc_operation_t operation);
     bool capture(vnc_operation_t operation);
+    // the image of the last capture() took microseconds to deliver, for the quality of the next JPEG
+    void report_delivery(size_t size, uint32_t microseconds);
 
     bool write_jpeg_buf(const std::string path);
 
+    // setter
+    // encodings and pseudo-encodings to advertise in order of preference, applied by configure().
+    // the ones not compiled in are left out.
+    void set_encoding_types(const std::vector<int32_t> &encoding_types) { this->encoding_types = encoding_types; };
+    // keep the native pixel format of the server instead of sending SetPixelFormat, applied by configure()
+    void set_native_pixel_format(bool native_pixel_format) { this->native_pixel_format = native_pixel_format; };
+    // 32 (BGRX), 16 (RGB565) or 8 (BGR233) bits per pixel to request when the native format is not used
+    bool set_capture_depth(uint8_t capture_depth);
+    // 8bpp colour map mode, the palette is kept by SetColourMapEntries
+    void set_colour_map(bool colour_map) { this->colour_map = colour_map; };
+    // strips of a large frame are compressed in parallel by this many threads
+    void set_encoder_threads(int threads) { this->encoder.set_threads(threads); };
+    // format of the image made by the next capture()
+    void set_image_format(image_format_t image_format) { this->image_format = image_format; };
+    // size of the image made by the next capture() to the frame buffer, it is never enlarged
+    void set_image_scale(double scale) { this->image_scale = std::min(1.0, std::max(0.0, scale)); };
+    // 1 to 100 for the lossy formats, 0 (fastest) to 9 for the compression level of PNG
+    // the JPEG quality is the highest one when the frame budget is set
+    void set_jpeg_quality(int quality);
+    void set_webp_quality(int quality) { this->webp_quality = std::max(1, std::min(100, quality)); };
+    void set_png_compression(int compression) { this->png_compression = std::max(0, std::min(9, compression)); };
+    // milliseconds to deliver a JPEG frame, 0 for the fixed quality
+    void set_frame_budget(uint32_t milliseconds);
+
     // getter
     const std::vector<uint8_t> get_jpeg_buf() const { return this->jpeg_buf; };
+    // image in the format set by set_image_format()
+    const std::vector<uint8_t> get_image_buf() const { return (this->image_format == IMAGE_FORMAT_JPEG) ? this->jpeg_buf : this->imencode_buf; };
+    const image_format_t get_image_format() const { return this->image_format; };
     const uint16_t get_width() const { return this->width; };
     const uint16_t get_height() const { return this->height; };
+    // size of the image, at least a pixel
+    const uint16_t get_image_width() const { return std::max<long>(1, std::min<long>(this->width, lround(this->width * this->image_scale))); };
+    const uint16_t get_image_height() const { return std::max<long>(1, std::min<long>(this->height, lround(this->height * this->image_scale))); };
     const std::string get_version() const { return this->version; }
+    // frame sequence is counted up by each frame buffer update which changes something
+    const uint32_t get_frame_sequence() const { return this->damage.get_sequence(); }
+    const std::vector<damage_rect_t> get_damage(uint32_t since_sequence) const { return this->damage.get_rects(since_sequence); }
+    // shape from the Cursor/XCursor pseudo-encodings, the size is 0 until the server sends one
+    const vnc_cursor_t get_cursor() const { return this->cursor; }
+    const std::vector<uint8_t> get_cursor_png() const { return this->cursor_png; }
+    // where the last pointer event was sent
+    const uint16_t get_pointer_x() const { return this->pointer_x; }
+    const uint16_t get_pointer_y() const { return this->pointer_y; }
 
     ////// make the following public for testing //////
     bool connect_to_server();
@@ -86,10 +295,15 @@ class vnc_client
     bool recv_set_colour_map_entries();
     bool recv_bell();
     bool recv_server_cut_text();
+    bool send_enable_continuous_updates(bool enable);
+    bool recv_end_of_continuous_updates();
+    bool pause_continuous_updates();
+    bool send_fence_request();
+    bool send_fence(uint32_t flags, const uint8_t *payload, uint8_t length);
+    bool recv_fence();
     bool send_key_event(std::string key);
     bool send_pointer_event(uint16_t x, uint16_t y, uint8_t button);
     bool draw_image();
-    bool draw_pointer(uint16_t x, uint16_t y);
     void clear_buf();
 };
 
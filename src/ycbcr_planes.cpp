@@ -0,0 +1,104 @@
+#include "ycbcr_planes.h"
+
+const uint16_t ycbcr_planes::MCU_SIZE;
+
+// fixed point coefficients of JFIF, rounded the same way as libjpeg
+static const int SCALE_BITS = 16;
+static const int32_t ONE_HALF = 1 << (SCALE_BITS - 1);
+static const int32_t CBCR_OFFSET = 128 << SCALE_BITS;
+#define FIX(x) ((int32_t)((x) * (1 << SCALE_BITS) + 0.5))
+
+void ycbcr_planes::resize(uint16_t width, uint16_t height, subsampling_t subsampling)
+{
+    this->subsampling = subsampling;
+    this->width = width;
+    this->height = height;
+    this->padded_width = (width + MCU_SIZE - 1) / MCU_SIZE * MCU_SIZE;
+    this->padded_height = (height + MCU_SIZE - 1) / MCU_SIZE * MCU_SIZE;
+    size_t pixels = (size_t)this->padded_width * this->padded_height;
+    this->strides[0] = this->padded_width;
+    int chroma_size = (subsampling == SUBSAMPLING_420) ? 2 : 1;
+    this->strides[1] = this->strides[2] = this->padded_width / chroma_size;
+    this->planes[0].assign(pixels, 0);
+    this->planes[1].assign(pixels / (chroma_size * chroma_size), 128);
+    this->planes[2].assign(pixels / (chroma_size * chroma_size), 128);
+}
+
+void ycbcr_planes::update(const frame_buffer &frame, const pixel_converter &converter, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+    if (width == 0 || height == 0 || frame.get_width() != this->width || frame.get_height() != this->height) {
+        return;
+    }
+    // whole 2x2 blocks, up to the end of the padding when the area reaches an edge.
+    // like libjpeg, the padding columns repeat the last pixel before the downsampling,
+    // while the padding rows repeat the last row of each plane after it
+    int first_x = x & ~1;
+    int first_y = y & ~1;
+    int last_x = (x + width >= this->width) ? this->padded_width : (x + width + 1) & ~1;
+    int last_y = std::min<int>(y + height + 1, this->height + 1) & ~1;
+    int columns = last_x - first_x;
+    int source_columns = std::min<int>(last_x, this->width) - first_x;
+    this->row_buf.resize(source_columns);
+    for (int i = 0; i < 2; i++) {
+        this->bgr_buf[i].resize(columns * 3);
+    }
+    for (int block_y = first_y; block_y < last_y; block_y += 2) {
+        for (int i = 0; i < 2; i++) {
+            uint8_t *bgr = this->bgr_buf[i].data();
+            frame.read_row(first_x, std::min<int>(block_y + i, this->height - 1), source_columns, this->row_buf.data());
+            converter.convert_row(this->row_buf.data(), bgr, source_columns);
+            for (int column = source_columns; column < columns; column++) {
+                memmove(&bgr[column * 3], &bgr[(source_columns - 1) * 3], 3);
+            }
+        }
+        uint8_t *luma[2] = {
+            &this->planes[0][this->strides[0] * block_y + first_x],
+            &this->planes[0][this->strides[0] * (block_y + 1) + first_x],
+        };
+        // 4:4:4 has a row of Cb and Cr for each row of Y, 4:2:0 has one for both
+        bool subsampled = (this->subsampling == SUBSAMPLING_420);
+        int chroma_x = subsampled ? first_x / 2 : first_x;
+        uint8_t *cb[2], *cr[2];
+        for (int i = 0; i < 2; i++) {
+            int chroma_y = subsampled ? block_y / 2 : block_y + i;
+            cb[i] = &this->planes[1][this->strides[1] * chroma_y + chroma_x];
+            cr[i] = &this->planes[2][this->strides[2] * chroma_y + chroma_x];
+        }
+        for (int column = 0; column < columns; column += 2) {
+            int32_t cb_sum = 0, cr_sum = 0;
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                    const uint8_t *bgr = &this->bgr_buf[i][(column + j) * 3];
+                    int32_t b = bgr[0], g = bgr[1], r = bgr[2];
+                    luma[i][column + j] = (FIX(0.29900) * r + FIX(0.58700) * g + FIX(0.11400) * b + ONE_HALF) >> SCALE_BITS;
+                    int32_t cb_value = (-FIX(0.16874) * r - FIX(0.33126) * g + FIX(0.50000) * b + CBCR_OFFSET + ONE_HALF - 1) >> SCALE_BITS;
+                    int32_t cr_value = (FIX(0.50000) * r - FIX(0.41869) * g - FIX(0.08131) * b + CBCR_OFFSET + ONE_HALF - 1) >> SCALE_BITS;
+                    if (!subsampled) {
+                        cb[i][column + j] = cb_value;
+                        cr[i][column + j] = cr_value;
+                    }
+                    cb_sum += cb_value;
+                    cr_sum += cr_value;
+                }
+            }
+            if (subsampled) {
+                // the bias alternates between 1 and 2 along a row, starting from the left edge
+                int bias = ((first_x + column) / 2 % 2 == 0) ? 1 : 2;
+                cb[0][column / 2] = (cb_sum + bias) >> 2;
+                cr[0][column / 2] = (cr_sum + bias) >> 2;
+            }
+        }
+    }
+    if (last_y < ((this->height + 1) & ~1)) {
+        // the last row of 2x2 blocks is kept, so is the padding below it
+        return;
+    }
+    for (int component = 0; component < 3; component++) {
+        int subsampling = (component == 0 || this->subsampling == SUBSAMPLING_444) ? 1 : 2;
+        int last_row = (subsampling == 1) ? this->height - 1 : last_y / 2 - 1;
+        const uint8_t *src = &this->planes[component][this->strides[component] * last_row + first_x / subsampling];
+        for (size_t row = last_row + 1; row < this->padded_height / subsampling; row++) {
+            memmove(&this->planes[component][this->strides[component] * row + first_x / subsampling], src, columns / subsampling);
+        }
+    }
+}
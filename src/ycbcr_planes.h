@@ -0,0 +1,49 @@
+#ifndef __YCBCR_PLANES_H__
+#define __YCBCR_PLANES_H__
+
+#include <bits/stdc++.h>
+
+#include "frame_buffer.h"
+#include "pixel_converter.h"
+
+// Planar YCbCr 4:2:0 or 4:4:4 of the frame buffer, the raw input of jpeg_encoder.
+// Only the damaged areas are converted again, the rest is kept from the earlier frames.
+// The planes are padded to whole MCUs of 16x16 by repeating the right and bottom edges,
+// and the conversion and the downsampling are the same as libjpeg does for its own input.
+class ycbcr_planes
+{
+ public:
+    typedef enum subsampling {
+        // Cb and Cr of 2x2 pixels, the default of libjpeg
+        SUBSAMPLING_420,
+        // Cb and Cr of every pixel
+        SUBSAMPLING_444,
+    } subsampling_t;
+ private:
+    subsampling_t subsampling = SUBSAMPLING_420;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint32_t padded_width = 0;
+    uint32_t padded_height = 0;
+    // Y, Cb and Cr
+    std::vector<uint8_t> planes[3];
+    size_t strides[3] = {};
+    // converted rows of a 2x2 block row
+    std::vector<uint32_t> row_buf;
+    std::vector<uint8_t> bgr_buf[2];
+ public:
+    static const uint16_t MCU_SIZE = 16;
+
+    // all pixels are black after resizing
+    void resize(uint16_t width, uint16_t height, subsampling_t subsampling = SUBSAMPLING_420);
+    // converts an area of the frame buffer of the same size, extended to whole 2x2 blocks
+    void update(const frame_buffer &frame, const pixel_converter &converter, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+    // row of a component, in its own subsampled rows up to the padding
+    const uint8_t *get_row(int component, uint16_t y) const { return &this->planes[component][this->strides[component] * y]; };
+
+    const uint16_t get_width() const { return this->width; };
+    const uint16_t get_height() const { return this->height; };
+    const subsampling_t get_subsampling() const { return this->subsampling; };
+};
+
+#endif
@@ -2,6 +2,8 @@
 // -I../ -I/usr/local/apr/include  -I/usr/local/apr/include/apr-1/ -I/usr/local/apache2/include
 // ../vnc_client.o ../logger.o ../d3des.o `pkg-config --libs opencv4`
 
+#include <arpa/inet.h>
+
 #include "gtest/gtest.h"
 #include "mrhc_common.h"
 #include "vnc_client.h"
@@ -12,6 +14,26 @@
 
 namespace {
 
+    std::vector<uint8_t> decode_jpeg(const std::vector<uint8_t> &jpeg)
+    {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_mgr error;
+        cinfo.err = jpeg_std_error(&error);
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, (unsigned char *)jpeg.data(), jpeg.size());
+        jpeg_read_header(&cinfo, TRUE);
+        cinfo.out_color_space = JCS_EXT_BGR;
+        jpeg_start_decompress(&cinfo);
+        std::vector<uint8_t> bgr(cinfo.output_width * cinfo.output_height * 3);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = &bgr[cinfo.output_scanline * cinfo.output_width * 3];
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return bgr;
+    }
+
     class mrhc_test : public ::testing::Test {
 
     protected:
@@ -33,6 +55,380 @@ namespace {
         EXPECT_EQ(0, v.get_height());
     }
 
+    TEST_F(mrhc_test, test_parse_encoding_type)
+    {
+        int32_t encoding_type = 0;
+        EXPECT_TRUE(vnc_client::parse_encoding_type("zrle", &encoding_type));
+        EXPECT_EQ(RFB_ENCODING_ZRLE, encoding_type);
+        EXPECT_TRUE(vnc_client::parse_encoding_type("cursor", &encoding_type));
+        EXPECT_EQ(RFB_ENCODING_CURSOR, encoding_type);
+        EXPECT_TRUE(vnc_client::parse_encoding_type("quality=6", &encoding_type));
+        EXPECT_EQ(RFB_ENCODING_QUALITY_LEVEL_0 + 6, encoding_type);
+        EXPECT_TRUE(vnc_client::parse_encoding_type("compress=0", &encoding_type));
+        EXPECT_EQ(RFB_ENCODING_COMPRESS_LEVEL_0, encoding_type);
+        EXPECT_FALSE(vnc_client::parse_encoding_type("quality=10", &encoding_type));
+        EXPECT_FALSE(vnc_client::parse_encoding_type("compress=", &encoding_type));
+        EXPECT_FALSE(vnc_client::parse_encoding_type("jpeg", &encoding_type));
+        EXPECT_TRUE(vnc_client::is_encoding_type_supported(RFB_ENCODING_RAW));
+        EXPECT_FALSE(vnc_client::is_encoding_type_supported(RFB_ENCODING_QUALITY_LEVEL_0 + 10));
+    }
+
+    TEST_F(mrhc_test, test_parse_image_format)
+    {
+        image_format_t image_format = IMAGE_FORMAT_JPEG;
+        EXPECT_TRUE(vnc_client::parse_image_format("webp", &image_format));
+        EXPECT_EQ(IMAGE_FORMAT_WEBP, image_format);
+        EXPECT_TRUE(vnc_client::parse_image_format("webp-lossless", &image_format));
+        EXPECT_EQ(IMAGE_FORMAT_WEBP_LOSSLESS, image_format);
+        EXPECT_TRUE(vnc_client::parse_image_format("png", &image_format));
+        EXPECT_EQ(IMAGE_FORMAT_PNG, image_format);
+        EXPECT_TRUE(vnc_client::parse_image_format("jpeg", &image_format));
+        EXPECT_EQ(IMAGE_FORMAT_JPEG, image_format);
+        EXPECT_FALSE(vnc_client::parse_image_format("gif", &image_format));
+        EXPECT_FALSE(vnc_client::parse_image_format("", &image_format));
+    }
+
+    TEST_F(mrhc_test, test_damage_region)
+    {
+        damage_region d = damage_region();
+        d.resize(200, 100);
+        // the whole area is damaged by resize
+        EXPECT_EQ(1, d.commit());
+        std::vector<damage_rect_t> rects = d.get_rects(0);
+        EXPECT_EQ(1, rects.size());
+        EXPECT_EQ(200, rects[0].width);
+        EXPECT_EQ(100, rects[0].height);
+        EXPECT_EQ(0, d.get_rects(1).size());
+        // nothing is committed without damage
+        EXPECT_EQ(1, d.commit());
+        // 2 tiles in the first row, coalesced with the 2 tiles below them
+        d.add(10, 10, 100, 100);
+        EXPECT_EQ(0, d.get_rects(1).size());
+        EXPECT_EQ(2, d.commit());
+        rects = d.get_rects(1);
+        EXPECT_EQ(1, rects.size());
+        EXPECT_EQ(0, rects[0].x);
+        EXPECT_EQ(0, rects[0].y);
+        EXPECT_EQ(128, rects[0].width);
+        EXPECT_EQ(100, rects[0].height);
+        // the last tile column is clipped by the width
+        d.add(199, 0, 1, 1);
+        EXPECT_EQ(3, d.commit());
+        rects = d.get_rects(2);
+        EXPECT_EQ(1, rects.size());
+        EXPECT_EQ(192, rects[0].x);
+        EXPECT_EQ(8, rects[0].width);
+        EXPECT_EQ(64, rects[0].height);
+        EXPECT_EQ(2, d.get_rects(1).size());
+    }
+
+    TEST_F(mrhc_test, test_frame_buffer)
+    {
+        frame_buffer f = frame_buffer();
+        f.resize(200, 100);
+        uint16_t length = 0;
+        // a span ends at the right edge of its tile or of the frame buffer
+        f.get_span(60, 70, &length);
+        EXPECT_EQ(4, length);
+        // every tile starts at a cache line
+        EXPECT_EQ(0, (uintptr_t)f.get_span(64, 64, &length) % frame_buffer::CACHE_LINE_SIZE);
+        f.get_span(192, 99, &length);
+        EXPECT_EQ(8, length);
+        // rows across the tiles, compared with a row-major copy
+        std::vector<uint32_t> expected(200 * 100);
+        for (int y = 0; y < 100; y++) {
+            for (int x = 0; x < 200; x++) {
+                expected[200 * y + x] = (y << 16) | x;
+            }
+            f.write_row(0, y, 200, &expected[200 * y]);
+        }
+        f.fill_rect(50, 20, 100, 30, 0xffffffff);
+        for (int y = 20; y < 50; y++) {
+            std::fill(&expected[200 * y + 50], &expected[200 * y + 150], 0xffffffff);
+        }
+        // overlapping downwards and to the right
+        f.copy_rect(10, 10, 40, 30, 150, 60);
+        for (int i = 59; i >= 0; i--) {
+            memmove(&expected[200 * (30 + i) + 40], &expected[200 * (10 + i) + 10], 150 * sizeof(uint32_t));
+        }
+        std::vector<uint32_t> row(200);
+        for (int y = 0; y < 100; y++) {
+            f.read_row(0, y, 200, row.data());
+            EXPECT_EQ(0, memcmp(&expected[200 * y], row.data(), 200 * sizeof(uint32_t))) << "y=" << y;
+        }
+    }
+
+    TEST_F(mrhc_test, test_pixel_converter)
+    {
+        pixel_format_t formats[] = {
+            // BGRX 32bpp, as requested to the server
+            {32, 24, 0, 1, htons(0xff), htons(0xff), htons(0xff), 16, 8, 0},
+            // RGBX 32bpp big endian
+            {32, 24, 1, 1, htons(0xff), htons(0xff), htons(0xff), 0, 8, 16},
+            // RGB565 little and big endian
+            {16, 16, 0, 1, htons(0x1f), htons(0x3f), htons(0x1f), 11, 5, 0},
+            {16, 16, 1, 1, htons(0x1f), htons(0x3f), htons(0x1f), 11, 5, 0},
+            // BGR233
+            {8, 8, 0, 1, htons(0x07), htons(0x07), htons(0x03), 0, 3, 6},
+        };
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            const pixel_format_t &pf = formats[f];
+            uint16_t maxes[3] = {ntohs(pf.blue_max), ntohs(pf.green_max), ntohs(pf.red_max)};
+            uint8_t shifts[3] = {pf.blue_shift, pf.green_shift, pf.red_shift};
+            std::vector<uint32_t> src(37);
+            std::vector<uint8_t> expected;
+            for (size_t i = 0; i < src.size(); i++) {
+                uint32_t value = (0x9e3779b9 * (i + 1)) >> (32 - pf.bits_per_pixel);
+                // pixels are kept in wire order
+                src[i] = !pf.big_endian_flag ? value : (pf.bits_per_pixel == 32) ? __builtin_bswap32(value) : __builtin_bswap16(value);
+                for (int c = 0; c < 3; c++) {
+                    uint32_t colour = (value >> shifts[c]) & maxes[c];
+                    expected.push_back((colour * 255 + maxes[c] / 2) / maxes[c]);
+                }
+            }
+            pixel_converter c;
+            c.set_pixel_format(pf);
+            pixel_converter::kernel_t kernels[] = {
+                pixel_converter::KERNEL_SCALAR, pixel_converter::KERNEL_FIXED, pixel_converter::KERNEL_LUT,
+                pixel_converter::KERNEL_SSSE3, pixel_converter::KERNEL_AVX2,
+            };
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                if (!c.select_kernel(kernels[k])) {
+                    EXPECT_NE(pixel_converter::KERNEL_SCALAR, kernels[k]);
+                    EXPECT_NE(pixel_converter::KERNEL_FIXED, kernels[k]);
+                    EXPECT_TRUE(pf.bits_per_pixel != 8 || kernels[k] != pixel_converter::KERNEL_LUT);
+                    continue;
+                }
+                // a byte past the row must be left as it is
+                std::vector<uint8_t> dst(src.size() * 3 + 1, 0xaa);
+                c.convert_row(src.data(), dst.data(), src.size());
+                EXPECT_EQ(0xaa, dst.back());
+                dst.pop_back();
+                EXPECT_EQ(expected, dst) << "format " << f << " kernel " << kernels[k];
+            }
+        }
+    }
+
+    TEST_F(mrhc_test, test_pixel_converter_colour_map)
+    {
+        pixel_format_t pf = {8, 8, 0, 0};
+        pixel_converter c;
+        c.set_pixel_format(pf);
+        EXPECT_EQ(pixel_converter::KERNEL_LUT, c.get_kernel());
+        EXPECT_FALSE(c.select_kernel(pixel_converter::KERNEL_SCALAR));
+        c.set_colour(1, 0xffff, 0x8000, 0x00ff);
+        c.set_colour(255, 0x1234, 0x5678, 0x9abc);
+        uint32_t src[3] = {1, 255, 0};
+        uint8_t dst[9] = {};
+        c.convert_row(src, dst, 3);
+        uint8_t expected[9] = {0x00, 0x80, 0xff, 0x9a, 0x56, 0x12, 0, 0, 0};
+        EXPECT_EQ(0, memcmp(expected, dst, sizeof(expected)));
+        // back to true colour, the colour map is not used
+        pf.true_colour_flag = 1;
+        pf.red_max = pf.green_max = htons(7);
+        pf.blue_max = htons(3);
+        pf.green_shift = 3;
+        pf.blue_shift = 6;
+        c.set_pixel_format(pf);
+        c.convert_row(src, dst, 1);
+        EXPECT_EQ(0, dst[0]);
+        EXPECT_EQ(0, dst[1]);
+        EXPECT_EQ(36, dst[2]);
+    }
+
+    TEST_F(mrhc_test, test_jpeg_encoder)
+    {
+        // rows are read stride bytes apart, the padding after each row is not compressed
+        uint16_t width = 37, height = 21;
+        size_t stride = width * 3 + 5;
+        std::vector<uint8_t> padded(stride * height, 0xaa), bgr(width * height * 3);
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            for (int c = 0; c < 3; c++) {
+                bgr[i * 3 + c] = padded[stride * (i / width) + i % width * 3 + c] = (uint8_t)(i * (c + 3));
+            }
+        }
+        jpeg_encoder encoder;
+        std::vector<uint8_t> from_padded, from_bgr;
+        EXPECT_TRUE(encoder.encode(padded.data(), width, height, stride, from_padded));
+        EXPECT_TRUE(encoder.encode(bgr.data(), width, height, width * 3, from_bgr));
+        EXPECT_EQ(from_bgr, from_padded);
+        EXPECT_EQ(0xff, from_bgr[0]);
+        EXPECT_EQ(0xd8, from_bgr[1]);
+        EXPECT_FALSE(encoder.encode(bgr.data(), 0, height, 0, from_bgr));
+    }
+
+    TEST_F(mrhc_test, test_jpeg_encoder_bands)
+    {
+        // 3 bands of 128 rows, the last one ends with a partial MCU row
+        uint16_t width = 75, height = 300;
+        std::vector<uint8_t> bgr(width * height * 3);
+        for (size_t i = 0; i < bgr.size(); i++) {
+            bgr[i] = (uint8_t)((i % 3) * (i / 3 % width) + (i / 3 / width) * 3);
+        }
+        jpeg_encoder bands;
+        bands.set_threads(2);
+        std::vector<uint8_t> from_bands;
+        EXPECT_TRUE(bands.encode(bgr.data(), width, height, width * 3, from_bands));
+        // the joined bands make one valid JPEG of the whole frame
+        EXPECT_EQ(width * height * 3, decode_jpeg(from_bands).size());
+
+        // the cached band is used until its rows are invalidated
+        std::vector<uint8_t> previous = from_bands;
+        bgr[width * 3 * 200] ^= 0xff;
+        EXPECT_TRUE(bands.encode(bgr.data(), width, height, width * 3, from_bands));
+        EXPECT_EQ(previous, from_bands);
+        bands.invalidate(200, 1);
+        EXPECT_TRUE(bands.encode(bgr.data(), width, height, width * 3, from_bands));
+        EXPECT_NE(previous, from_bands);
+        jpeg_encoder fresh;
+        std::vector<uint8_t> from_fresh;
+        EXPECT_TRUE(fresh.encode(bgr.data(), width, height, width * 3, from_fresh));
+        EXPECT_EQ(from_fresh, from_bands);
+    }
+
+    TEST_F(mrhc_test, test_ycbcr_planes)
+    {
+        // odd sizes for the padding on the right and at the bottom
+        uint16_t width = 75, height = 141;
+        frame_buffer frame = frame_buffer();
+        frame.resize(width, height);
+        std::vector<uint32_t> bgrx(width * height);
+        for (size_t i = 0; i < bgrx.size(); i++) {
+            bgrx[i] = 0x9e3779b9 * (i + 1) >> 8;
+        }
+        for (int y = 0; y < height; y++) {
+            frame.write_row(0, y, width, &bgrx[width * y]);
+        }
+        pixel_converter converter;
+        ycbcr_planes planes = ycbcr_planes();
+        planes.resize(width, height);
+        planes.update(frame, converter, 0, 0, width, height);
+        // the same JPEG as libjpeg converts the pixels by itself
+        auto to_bgr = [&]() {
+            std::vector<uint8_t> bgr;
+            for (uint32_t pixel : bgrx) {
+                for (int c = 0; c < 3; c++) {
+                    bgr.push_back(pixel >> (c * 8));
+                }
+            }
+            return bgr;
+        };
+        jpeg_encoder from_planes, from_pixels;
+        std::vector<uint8_t> expected, actual;
+        EXPECT_TRUE(from_pixels.encode(to_bgr().data(), width, height, width * 3, expected));
+        EXPECT_TRUE(from_planes.encode(planes, actual));
+        EXPECT_EQ(expected, actual);
+
+        // an odd area reaching the bottom is converted again with its 2x2 blocks and the padding
+        bgrx[width * 139 + 33] = 0x00ffffff;
+        frame.write_row(0, 139, width, &bgrx[width * 139]);
+        planes.update(frame, converter, 33, 139, 1, 2);
+        from_planes.invalidate(139, 2);
+        from_pixels.invalidate_all();
+        EXPECT_TRUE(from_pixels.encode(to_bgr().data(), width, height, width * 3, expected));
+        EXPECT_TRUE(from_planes.encode(planes, actual));
+        EXPECT_EQ(expected, actual);
+
+        // 4:4:4 is compressed in the subsampling of the planes
+        planes.resize(width, height, ycbcr_planes::SUBSAMPLING_444);
+        planes.update(frame, converter, 0, 0, width, height);
+        from_pixels.set_subsampling(ycbcr_planes::SUBSAMPLING_444);
+        EXPECT_TRUE(from_pixels.encode(to_bgr().data(), width, height, width * 3, expected));
+        EXPECT_TRUE(from_planes.encode(planes, actual));
+        EXPECT_EQ(expected, actual);
+    }
+
+    TEST_F(mrhc_test, test_quality_controller)
+    {
+        quality_controller controller = quality_controller();
+        controller.set_max_quality(90);
+        EXPECT_FALSE(controller.is_enabled());
+        EXPECT_EQ(90, controller.get_level().quality);
+        EXPECT_EQ(ycbcr_planes::SUBSAMPLING_444, controller.get_level().subsampling);
+        // nothing is controlled without the budget
+        controller.report(100000, 1000000);
+        EXPECT_EQ(ycbcr_planes::SUBSAMPLING_444, controller.get_level().subsampling);
+        controller.set_budget(100);
+        // 150 msec is over the budget of 100 msec, 4:2:0 at the same quality
+        controller.report(100000, 150000);
+        EXPECT_EQ(90, controller.get_level().quality);
+        EXPECT_EQ(ycbcr_planes::SUBSAMPLING_420, controller.get_level().subsampling);
+        // far over the budget, down to the lowest quality at once
+        controller.report(10000000, 10000000);
+        EXPECT_EQ(quality_controller::MIN_QUALITY, controller.get_level().quality);
+        // a fast link steps up only after a few frames
+        controller.report(10000, 1000);
+        controller.report(10000, 1000);
+        EXPECT_EQ(quality_controller::MIN_QUALITY, controller.get_level().quality);
+        controller.report(10000, 1000);
+        EXPECT_EQ(quality_controller::MIN_QUALITY + quality_controller::QUALITY_STEP, controller.get_level().quality);
+    }
+
+    TEST_F(mrhc_test, test_image_scaler)
+    {
+        // odd sizes for boxes of 3 and 4 pixels
+        uint16_t width = 75, height = 41;
+        frame_buffer frame = frame_buffer();
+        frame.resize(width, height);
+        std::vector<uint32_t> bgrx(width * height);
+        for (size_t i = 0; i < bgrx.size(); i++) {
+            bgrx[i] = 0x9e3779b9 * (i + 1) >> 8;
+        }
+        for (int y = 0; y < height; y++) {
+            frame.write_row(0, y, width, &bgrx[width * y]);
+        }
+        pixel_converter converter;
+        image_scaler scaler = image_scaler();
+        scaler.resize(width, height, 23, 13);
+        EXPECT_EQ(23, scaler.get_width());
+        EXPECT_EQ(13, scaler.get_height());
+        // rounded average of the box in each channel
+        std::vector<uint8_t> expected(23 * 13 * 3);
+        for (int j = 0; j < 13; j++) {
+            for (int i = 0; i < 23; i++) {
+                int x0 = i * width / 23, x1 = (i + 1) * width / 23;
+                int y0 = j * height / 13, y1 = (j + 1) * height / 13;
+                int area = (x1 - x0) * (y1 - y0);
+                for (int c = 0; c < 3; c++) {
+                    int total = 0;
+                    for (int y = y0; y < y1; y++) {
+                        for (int x = x0; x < x1; x++) {
+                            total += (bgrx[width * y + x] >> (c * 8)) & 0xff;
+                        }
+                    }
+                    expected[(j * 23 + i) * 3 + c] = (total + area / 2) / area;
+                }
+            }
+        }
+        image_scaler::kernel_t kernels[] = {image_scaler::KERNEL_SCALAR, image_scaler::KERNEL_SSE2, image_scaler::KERNEL_AVX2};
+        for (image_scaler::kernel_t kernel : kernels) {
+            if (!scaler.select_kernel(kernel)) {
+                continue;
+            }
+            std::vector<uint8_t> actual(23 * 13 * 3);
+            scaler.scale(frame, converter, 0, 0, 23, 13, actual.data(), 23 * 3);
+            EXPECT_EQ(expected, actual);
+        }
+
+        // a damaged pixel is in one box, on the edge of a box only the boxes touching it
+        uint16_t x = 40, y = 20, w = 1, h = 1;
+        scaler.map_area(&x, &y, &w, &h);
+        EXPECT_EQ(12, x);
+        EXPECT_EQ(6, y);
+        EXPECT_EQ(1, w);
+        EXPECT_EQ(1, h);
+        x = 0, y = 0, w = width, h = height;
+        scaler.map_area(&x, &y, &w, &h);
+        EXPECT_EQ(0, x);
+        EXPECT_EQ(23, w);
+        EXPECT_EQ(13, h);
+
+        // never larger than the frame buffer
+        scaler.resize(width, height, 100, 100);
+        EXPECT_EQ(width, scaler.get_width());
+        EXPECT_EQ(height, scaler.get_height());
+    }
+
     TEST_F(mrhc_test, test_connect_to_server)
     {
         vnc_client v = vnc_client("127.0.0.1", MRHC_TEST_PORT_3_8, "testtest");